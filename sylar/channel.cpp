@@ -0,0 +1,180 @@
+#include "channel.h"
+#include "scheduler.h"
+#include "macro.h"
+
+namespace sylar {
+
+ChannelBase::ChannelBase(size_t capacity)
+    :m_capacity(capacity) {
+    SYLAR_ASSERT(capacity > 0);
+}
+
+void ChannelBase::close() {
+    std::vector<ChannelWaiter::ptr> waiters;
+    Spinlock::Lock lock(m_mutex);
+    if (m_closed) {
+        return ;
+    }
+    m_closed = true;
+    while (ChannelWaiter::ptr w = Claim(m_sendq)) {
+        waiters.push_back(std::move(w));
+    }
+    while (ChannelWaiter::ptr w = Claim(m_recvq)) {
+        waiters.push_back(std::move(w));
+    }
+    // 释放锁之后再调度, 调度可能写 eventfd
+    lock.unlock();
+    for (auto& i : waiters) {
+        Wake(i);
+    }
+}
+
+bool ChannelBase::isClosed() {
+    Spinlock::Lock lock(m_mutex);
+    return m_closed;
+}
+
+bool ChannelBase::wait(ChannelCase& c) {
+    Select(&c, 1, true);
+    return c.ok;
+}
+
+bool ChannelBase::tryOnce(ChannelCase& c) {
+    return Select(&c, 1, false) >= 0 && c.ok;
+}
+
+int ChannelBase::Select(std::vector<ChannelCase>& cases, bool block) {
+    SYLAR_ASSERT(!cases.empty());
+    return Select(&cases[0], cases.size(), block);
+}
+
+int ChannelBase::Select(ChannelCase* cases, size_t count, bool block) {
+    size_t first = 0;
+    while (true) {
+        for (size_t k = 0; k < count; ++k) {
+            size_t i = (first + k) % count;
+            if (cases[i].channel->tryCase(cases[i])) {
+                return i;
+            }
+        }
+        if (!block) {
+            return -1;
+        }
+
+        ChannelWaiter::ptr waiter = std::make_shared<ChannelWaiter>(count);
+        waiter->scheduler = Scheduler::GetThis();
+        SYLAR_ASSERT(waiter->scheduler);
+        waiter->fiber = Fiber::GetThis();
+        size_t registered = 0;
+        for (; registered < count; ++registered) {
+            if (!cases[registered].channel->enqueue(cases[registered], waiter, registered)) {
+                break;
+            }
+        }
+        if (registered == count) {
+            // 挂到所有通道之后挂起, 在此之前就可能被唤醒, 调度器会等协程切出后再换入
+            Fiber::YieldToHold();
+        } else {
+            // 登记途中有分支已经就绪, 撤销等待
+            // 已经被其他通道占有时, 对方一定会调度自己, 要挂起一次把这次唤醒消耗掉
+            int expected = -1;
+            if (!waiter->woken.compare_exchange_strong(expected, (int)registered)) {
+                Fiber::YieldToHold();
+            }
+        }
+        for (size_t i = 0; i < registered; ++i) {
+            cases[i].channel->dequeue(cases[i], *waiter, i);
+        }
+        // 唤醒自己的分支最可能就绪, 从它开始重试
+        // 它的数据被别人抢走时重新等待, 不会让其他等待者错过唤醒
+        first = waiter->woken;
+        waiter->fiber.reset();
+    }
+}
+
+bool ChannelBase::tryCase(ChannelCase& c) {
+    ChannelWaiter::ptr waiter;
+    Spinlock::Lock lock(m_mutex);
+    if (c.send) {
+        if (m_closed) {
+            c.ok = false;
+            return true;
+        }
+        if (size() >= m_capacity) {
+            return false;
+        }
+        push(c.value);
+        waiter = Claim(m_recvq);
+    } else {
+        if (size() == 0) {
+            if (!m_closed) {
+                return false;
+            }
+            c.ok = false;
+            return true;
+        }
+        pop(c.value);
+        waiter = Claim(m_sendq);
+    }
+    c.ok = true;
+    lock.unlock();
+    if (waiter) {
+        Wake(waiter);
+    }
+    return true;
+}
+
+bool ChannelBase::enqueue(ChannelCase& c, const ChannelWaiter::ptr& waiter, size_t index) {
+    Spinlock::Lock lock(m_mutex);
+    if (m_closed) {
+        return false;
+    }
+    std::list<ChannelWaitNode>* queue;
+    if (c.send) {
+        if (size() < m_capacity) {
+            return false;
+        }
+        queue = &m_sendq;
+    } else {
+        if (size() > 0) {
+            return false;
+        }
+        queue = &m_recvq;
+    }
+    ChannelWaiter::Entry& entry = waiter->entries[index];
+    entry.pos = queue->insert(queue->end(), {waiter, index});
+    entry.queued = true;
+    return true;
+}
+
+void ChannelBase::dequeue(ChannelCase& c, ChannelWaiter& waiter, size_t index) {
+    Spinlock::Lock lock(m_mutex);
+    ChannelWaiter::Entry& entry = waiter.entries[index];
+    if (entry.queued) {
+        (c.send ? m_sendq : m_recvq).erase(entry.pos);
+        entry.queued = false;
+    }
+}
+
+ChannelWaiter::ptr ChannelBase::Claim(std::list<ChannelWaitNode>& queue) {
+    while (!queue.empty()) {
+        ChannelWaitNode node = std::move(queue.front());
+        queue.pop_front();
+        node.waiter->entries[node.index].queued = false;
+        int expected = -1;
+        if (node.waiter->woken.compare_exchange_strong(expected, (int)node.index)) {
+            return std::move(node.waiter);
+        }
+    }
+    return nullptr;
+}
+
+void ChannelBase::Wake(const ChannelWaiter::ptr& waiter) {
+    // 调度之后等待的协程可能马上恢复并清空 fiber, 先取出需要的数据
+    Scheduler* scheduler = waiter->scheduler;
+    Fiber::ptr fiber = waiter->fiber;
+    int thread = fiber->getBoundThread();
+    scheduler->schedule(std::move(fiber), thread);
+}
+
+}
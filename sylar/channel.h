@@ -0,0 +1,181 @@
+#ifndef __SYLAR_CHANNEL_H__
+#define __SYLAR_CHANNEL_H__
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <vector>
+#include "mutex.h"
+#include "noncopyable.h"
+#include "fiber.h"
+
+namespace sylar {
+
+class Scheduler;
+class ChannelBase;
+struct ChannelWaiter;
+
+// 协程通道, 在流水线的各个阶段之间传递数据
+// 有界缓冲, 满时 send 挂起, 空时 recv 挂起, 挂起的只是当前协程
+// 等待的协程被唤醒时交回它所在的调度器, 可以跨线程, 也可以跨 IOManager
+// 值通过移动传入传出, 不做拷贝
+
+// 通道等待队列中的一项, 对应某个等待者的第 index 个分支
+struct ChannelWaitNode {
+    std::shared_ptr<ChannelWaiter> waiter;
+    size_t index;
+};
+
+// 挂起在通道上的协程, 可以同时挂在多个通道上 (Select)
+// 协程切出后其他线程还会访问, 放在堆上, 共享栈协程切出后栈会被下一个协程覆盖
+// 第一个唤醒它的通道通过 CAS 占有它, 其余通道跳过
+struct ChannelWaiter {
+    typedef std::shared_ptr<ChannelWaiter> ptr;
+
+    ChannelWaiter(size_t count)
+        :entries(count) {
+    }
+
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    // 唤醒它的分支下标, 未被唤醒时为 -1
+    std::atomic<int> woken = {-1};
+    // 每个分支在对应通道等待队列中的位置, 在该通道的锁内读写
+    struct Entry {
+        std::list<ChannelWaitNode>::iterator pos;
+        bool queued = false;
+    };
+    std::vector<Entry> entries;
+};
+
+// Select 的一个分支, 由 Channel::sendCase / recvCase 生成
+// 只由发起等待的协程自己读写, 唤醒后由它自己完成收发
+struct ChannelCase {
+    ChannelCase(ChannelBase* c, bool s, void* v)
+        :channel(c)
+        ,send(s)
+        ,value(v) {
+    }
+
+    ChannelBase* channel;
+    bool send;
+    void* value;
+    // 完成的分支: send 写入 / recv 读到数据为 true, 通道已关闭为 false
+    bool ok = false;
+};
+
+// 与类型无关的部分: 缓冲区状态判断, 等待队列和 Select
+class ChannelBase : Noncopyable {
+public:
+    // capacity 至少为 1
+    ChannelBase(size_t capacity);
+    virtual ~ChannelBase() {}
+
+    // 关闭通道, 唤醒所有等待者
+    // 关闭后 send 失败, recv 仍可读完缓冲区中剩余的数据, 之后失败
+    void close();
+    bool isClosed();
+    size_t getCapacity() const { return m_capacity; }
+
+    // 等待任意一个分支完成, 返回它的下标, 结果看 cases[i].ok
+    // 多个分支同时就绪时从前往后选, 被唤醒后优先尝试唤醒自己的分支
+    // block 为 false 时没有就绪的分支立即返回 -1
+    // 阻塞只能在调度器中运行的协程里调用, 等待期间 cases 不能被修改
+    static int Select(std::vector<ChannelCase>& cases, bool block = true);
+protected:
+    // 单个分支的阻塞/非阻塞操作, 返回 ok
+    bool wait(ChannelCase& c);
+    bool tryOnce(ChannelCase& c);
+
+    // 以下在锁内调用
+    virtual size_t size() const = 0;
+    // 从 value 指向的对象移入缓冲区
+    virtual void push(void* value) = 0;
+    // 缓冲区头部移出到 value 指向的对象
+    virtual void pop(void* value) = 0;
+private:
+    static int Select(ChannelCase* cases, size_t count, bool block);
+    // 能完成时完成操作并唤醒对端的一个等待者, 返回 true
+    bool tryCase(ChannelCase& c);
+    // 不能完成时把 waiter 的第 index 个分支挂到等待队列返回 true, 已经就绪返回 false
+    bool enqueue(ChannelCase& c, const ChannelWaiter::ptr& waiter, size_t index);
+    void dequeue(ChannelCase& c, ChannelWaiter& waiter, size_t index);
+    // 从队列中取出第一个还没被其他通道占有的等待者
+    static ChannelWaiter::ptr Claim(std::list<ChannelWaitNode>& queue);
+    static void Wake(const ChannelWaiter::ptr& waiter);
+private:
+    Spinlock m_mutex;
+    size_t m_capacity;
+    bool m_closed = false;
+    std::list<ChannelWaitNode> m_sendq;
+    std::list<ChannelWaitNode> m_recvq;
+};
+
+// 有界多生产者多消费者通道
+template<class T>
+class Channel : public ChannelBase {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    Channel(size_t capacity)
+        :ChannelBase(capacity) {
+    }
+
+    // 缓冲区满时挂起, 通道已关闭返回 false, 此时 value 不被移走
+    bool send(T&& value) {
+        ChannelCase c(this, true, &value);
+        return wait(c);
+    }
+
+    bool send(const T& value) {
+        T v(value);
+        return send(std::move(v));
+    }
+
+    // 缓冲区为空时挂起, 通道已关闭且读完返回 false
+    bool recv(T& value) {
+        ChannelCase c(this, false, &value);
+        return wait(c);
+    }
+
+    // 不挂起, 缓冲区满或通道已关闭返回 false, 可以在任意线程调用
+    bool trySend(T&& value) {
+        ChannelCase c(this, true, &value);
+        return tryOnce(c);
+    }
+
+    // 不挂起, 缓冲区为空或通道已关闭且读完返回 false, 可以在任意线程调用
+    bool tryRecv(T& value) {
+        ChannelCase c(this, false, &value);
+        return tryOnce(c);
+    }
+
+    // Select 的分支, 发送成功时从 value 移走数据
+    ChannelCase sendCase(T& value) {
+        return ChannelCase(this, true, &value);
+    }
+
+    ChannelCase recvCase(T& value) {
+        return ChannelCase(this, false, &value);
+    }
+protected:
+    size_t size() const override {
+        return m_buffer.size();
+    }
+
+    void push(void* value) override {
+        m_buffer.push_back(std::move(*static_cast<T*>(value)));
+    }
+
+    void pop(void* value) override {
+        *static_cast<T*>(value) = std::move(m_buffer.front());
+        m_buffer.pop_front();
+    }
+private:
+    std::deque<T> m_buffer;
+};
+
+}
+
+#endif
@@ -3,9 +3,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <atomic>
 
 namespace sylar {
 
+static std::atomic<uint64_t> s_fd_generation = {0};
+
 FdCtx::FdCtx(int fd)
     :m_isInit(false)
     ,m_isSocket(false)
@@ -14,7 +17,8 @@ FdCtx::FdCtx(int fd)
     ,m_isClosed(false)
     ,m_fd(fd)
     ,m_recvTimeout(-1)
-    ,m_sendTimeout(-1) {
+    ,m_sendTimeout(-1)
+    ,m_generation(++s_fd_generation) {
     init();
 }
 
@@ -85,8 +89,14 @@ FdCtx::ptr FdManager::get(int fd, bool auto_create) {
         }
     }
     lock.unlock();
+    return create(fd);
+}
 
-    RWMutexType::WriteLock lock2(m_mutex);
+FdCtx::ptr FdManager::create(int fd) {
+    RWMutexType::WriteLock lock(m_mutex);
+    if (m_datas.size() <= (size_t)fd) {
+        m_datas.resize(fd + fd / 2 + 1);
+    }
     FdCtx::ptr ctx(new FdCtx(fd));
     m_datas[fd] = ctx;
     return ctx;
@@ -29,6 +29,8 @@ public:
 
     void setTimeout(int type, uint64_t v);
     uint64_t getTimeout(int type);
+    // 每个上下文的代数都不同, 同一个 fd 号关闭后重新创建的 fd 据此区分
+    uint64_t getGeneration() const { return m_generation; }
 private:
     bool m_isInit;
     bool m_isSocket;
@@ -38,6 +40,7 @@ private:
     int m_fd;
     uint64_t m_recvTimeout;
     uint64_t m_sendTimeout;
+    uint64_t m_generation;
     //sylar::IOManager* m_iomanager;
 };
 
@@ -47,6 +50,9 @@ public:
     FdManager();
 
     FdCtx::ptr get(int fd, bool auto_create = false);
+    // 为刚由 socket / accept 返回的 fd 新建上下文, 替换掉已有的
+    // fd 不经过 hook 关闭时(close_f, 没有开启 hook 的线程)旧的上下文不会被删除, 不能沿用
+    FdCtx::ptr create(int fd);
     void del(int fd);
 private:
     RWMutexType m_mutex;
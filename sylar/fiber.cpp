@@ -2,7 +2,12 @@
 #include "macro.h"
 #include "scheduler.h"
 #include "log.h"
+#include "config.h"
 #include <atomic>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 namespace sylar {
 
@@ -12,18 +17,168 @@ static std::atomic<uint64_t> s_fiber_count {0};
 static thread_local Fiber* t_fiber = nullptr;
 static thread_local Fiber::ptr t_threadFiber = nullptr;     // the main fiber
 
-class MallocStackAllocator {
+static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
+    Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
+
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024
+            , "size of the per-thread stack shared by shared-stack fibers");
+
+static ConfigVar<uint32_t>::ptr g_fiber_stack_cache_count =
+    Config::Lookup<uint32_t>("fiber.stack_cache_count", 256
+            , "max cached fiber stacks per thread");
+
+static ConfigVar<bool>::ptr g_fiber_numa_local_stack =
+    Config::Lookup<bool>("fiber.numa_local_stack", true
+            , "prefer the numa node of the allocating thread for fiber stacks");
+
+// 配置的值缓存在这里, 避免每次创建协程都去读配置的读写锁
+static std::atomic<uint32_t> s_fiber_stack_size {128 * 1024};
+static std::atomic<uint32_t> s_fiber_stack_cache_count {256};
+static std::atomic<bool> s_fiber_numa_local_stack {true};
+
+struct _FiberIniter {
+    _FiberIniter() {
+        s_fiber_stack_size = g_fiber_stack_size->getValue();
+        s_fiber_stack_cache_count = g_fiber_stack_cache_count->getValue();
+        s_fiber_numa_local_stack = g_fiber_numa_local_stack->getValue();
+        g_fiber_numa_local_stack->addListener([](const bool& old_value, const bool& new_value){
+            s_fiber_numa_local_stack = new_value;
+        });
+        g_fiber_stack_size->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_fiber_stack_size = new_value;
+        });
+        g_fiber_stack_cache_count->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_fiber_stack_cache_count = new_value;
+        });
+    }
+};
+
+static _FiberIniter s_fiber_initer;
+
+// 每个线程缓存一部分已经释放的栈, 按栈大小分开存放
+struct StackCache {
+    ~StackCache();
+    std::unordered_map<size_t, std::vector<void*> > stacks;
+    size_t count = 0;
+};
+
+// 线程退出时 StackCache 析构并置空指针, 之后释放的栈直接归还系统
+static thread_local StackCache* t_stack_cache = nullptr;
+static thread_local StackCache t_stack_cache_holder;
+
+// 使用 mmap 分配栈, 栈底下方留一个不可访问的保护页, 栈溢出时直接触发段错误
+// 而不是悄悄改写相邻的内存
+class MmapStackAllocator {
     public:
+        static size_t PageSize() {
+            static size_t s_page_size = sysconf(_SC_PAGESIZE);
+            return s_page_size;
+        }
+
         static void* Alloc(size_t size) {
-            return malloc(size);
+            size_t page = PageSize();
+            size = (size + page - 1) / page * page;
+            if (!t_stack_cache) {
+                t_stack_cache = &t_stack_cache_holder;
+            }
+            auto it = t_stack_cache->stacks.find(size);
+            if (it != t_stack_cache->stacks.end() && !it->second.empty()) {
+                void* vp = it->second.back();
+                it->second.pop_back();
+                --t_stack_cache->count;
+                return vp;
+            }
+
+            void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE
+                            , MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+            if (base == MAP_FAILED) {
+                std::cout << "mmap fiber stack failed, size=" << size 
+                    << " errno=" << errno << std::endl;
+                SYLAR_ASSERT2(false, "mmap");
+                return nullptr;
+            }
+            // 栈向低地址增长, 保护页放在最低处
+            if (mprotect(base, page, PROT_NONE)) {
+                std::cout << "mprotect fiber stack guard failed, errno=" << errno << std::endl;
+            }
+            BindLocalNode((char*)base + page, size);
+            return (char*)base + page;
+        }
+
+        // 多 NUMA 节点时, 栈的物理页优先从当前线程所在的节点分配
+        // 否则 make_fcontext 在创建线程写入栈顶, 首次访问的页可能落在别的节点
+        // 线程绑定了 CPU 时, 缓存中的栈也一直是本节点的
+        static void BindLocalNode(void* vp, size_t size) {
+            if (!s_fiber_numa_local_stack || GetNumaNodeCount() <= 1) {
+                return ;
+            }
+            int node = GetNumaNode();
+            if (node < 0 || node >= 64) {
+                return ;
+            }
+            // MPOL_PREFERRED, 本节点内存不足时仍可以从其他节点分配
+            static const int s_mpol_preferred = 1;
+            unsigned long mask = 1ul << node;
+            if (syscall(SYS_mbind, vp, size, s_mpol_preferred, &mask, 64, 0)) {
+                std::cout << "mbind fiber stack failed, node=" << node 
+                    << " errno=" << errno << std::endl;
+            }
         }
 
         static void Dealloc(void* vp, size_t size) {
-            return free(vp);
+            size_t page = PageSize();
+            size = (size + page - 1) / page * page;
+            if (t_stack_cache && t_stack_cache->count < s_fiber_stack_cache_count) {
+                t_stack_cache->stacks[size].push_back(vp);
+                ++t_stack_cache->count;
+                return ;
+            }
+            munmap((char*)vp - page, size + page);
+        }
+};
+
+StackCache::~StackCache() {
+    t_stack_cache = nullptr;
+    size_t page = MmapStackAllocator::PageSize();
+    for (auto& i : stacks) {
+        for (auto vp : i.second) {
+            munmap((char*)vp - page, i.first + page);
+        }
+    }
+}
+
+using StackAllocator = MmapStackAllocator;
+
+// 每个线程一个共享栈, 共享栈模式的协程都在上面运行
+// 切换到另一个协程时才把当前占用者用到的部分拷贝出去
+struct SharedStack {
+    ~SharedStack() {
+        if (stack) {
+            StackAllocator::Dealloc(stack, size);
         }
+    }
+    void* stack = nullptr;
+    size_t size = 0;
+    // 栈上现在保存的是哪个协程的数据
+    Fiber* occupant = nullptr;
+    // 绑定在本线程上已经开始运行还没有结束的协程数
+    size_t bound = 0;
 };
 
-using StackAllocator = MallocStackAllocator;
+static thread_local SharedStack t_shared_stack;
+
+static SharedStack* GetSharedStack() {
+    if (!t_shared_stack.stack) {
+        t_shared_stack.size = g_fiber_shared_stack_size->getValue();
+        t_shared_stack.stack = StackAllocator::Alloc(t_shared_stack.size);
+    }
+    return &t_shared_stack;
+}
+
+uint32_t Fiber::GetDefaultStackSize() {
+    return s_fiber_stack_size;
+}
 // 返回当前运行协程的 id
 uint64_t Fiber::GetFiberId() {
     if (t_fiber) {
@@ -40,45 +195,55 @@ Fiber::Fiber() {
     m_state = EXEC;
     // 设置当前运行协程为此协程
     SetThis(this);
+#if !SYLAR_FIBER_ASM_CONTEXT
     // 获取线程运行的上下文
+    // 汇编实现在第一次切出时才保存上下文, 这里不需要
     if (getcontext(&m_ctx)) {
         SYLAR_ASSERT2(false, "getcontext");
     }
+#endif
     // 增加协程数
     ++s_fiber_count;
     loginfo2("create a fiber with no param");
 }
 // 带参构造
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller
+            , bool shared_stack)
         :m_id(++s_fiber_id)
-        ,m_cb(cb) {
+        ,m_sharedStack(shared_stack)
+        ,m_cb(std::move(cb)) {
     // 增加协程数
     ++s_fiber_count;
+    // 共享栈协程在第一次运行时才绑定线程的共享栈并构造上下文
+    if (m_sharedStack) {
+        SYLAR_ASSERT(!use_caller);
+        m_stacksize = 0;
+        loginfo2("create a shared stack fiber with param");
+        return ;
+    }
     // 设置栈大小
-    m_stacksize = stacksize ? stacksize : 128 * 1024;
+    m_stacksize = stacksize ? stacksize : GetDefaultStackSize();
     // 调用库函数分配栈空间
     m_stack = StackAllocator::Alloc(m_stacksize);
-    // 获取上下文
-    if (getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "getcontext");
-    }
-    // 设置上下文中的栈和栈空间
-    // uc.link 为 nullptr 表示结束后不会自动切换
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
     // 为线程绑定上下文的入口函数
     if (!use_caller) {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
+        makeContext(&Fiber::MainFunc);
     } else {
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+        makeContext(&Fiber::CallerMainFunc);
     }
     loginfo2("create a fiber with param");
 }
 
 Fiber::~Fiber() {
     --s_fiber_count;
-    if (m_stack) {
+    if (m_sharedStack) {
+        // 共享栈不属于协程, 只释放保存的栈数据
+        SYLAR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
+        if (m_thread == sylar::GetThreadId() && t_shared_stack.occupant == this) {
+            t_shared_stack.occupant = nullptr;
+        }
+        free(m_savedStack);
+    } else if (m_stack) {
         SYLAR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
         StackAllocator::Dealloc(m_stack, m_stacksize);
     } else {
@@ -93,25 +258,122 @@ Fiber::~Fiber() {
     loginfo2("delete a fiber, id: " + std::to_string(m_id));
 }
 // 重设协程需要执行的函数
-void Fiber::reset(std::function<void()> cb) {
+void Fiber::reset(Task cb) {
     // 确定栈存在
-    SYLAR_ASSERT(m_stack);
+    SYLAR_ASSERT(m_stack || m_sharedStack);
     // 确认协程的状态
     SYLAR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
     // 绑定需要执行的函数
-    m_cb = cb;
+    m_cb = std::move(cb);
+    // 设置上下文的入口函数
+    // 共享栈上可能还有其他协程的数据, 等到 swapIn 占用共享栈时再构造
+    if (!m_sharedStack) {
+        makeContext(&Fiber::MainFunc);
+    }
+    // 协程状态为初始化
+    m_state = INIT;
+}
+
+void Fiber::makeContext(void (*func)()) {
+#if SYLAR_FIBER_ASM_CONTEXT
+    m_ctx = make_fcontext(m_stack, m_stacksize, func);
+#else
     // 获取上下文
     if (getcontext(&m_ctx)) {
         SYLAR_ASSERT2(false, "getcontext");
     }
-    // 设置栈空间
+    // 设置上下文中的栈和栈空间
+    // uc.link 为 nullptr 表示结束后不会自动切换
     m_ctx.uc_link = nullptr;
     m_ctx.uc_stack.ss_sp = m_stack;
     m_ctx.uc_stack.ss_size = m_stacksize;
-    // 设置上下文的入口函数
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    // 协程状态为初始化
-    m_state = INIT;
+    makecontext(&m_ctx, func, 0);
+#endif
+}
+
+void Fiber::SwitchContext(Fiber* from, Fiber* to) {
+#if SYLAR_FIBER_ASM_CONTEXT
+    sylar_jump_fcontext(&from->m_ctx, to->m_ctx);
+#else
+    // glibc 的 swapcontext 每次都会调用 rt_sigprocmask
+    if (swapcontext(&from->m_ctx, &to->m_ctx)) {
+        SYLAR_ASSERT2(false, "swapcontext");
+    }
+#endif
+}
+
+void* Fiber::getContextSp() const {
+#if SYLAR_FIBER_ASM_CONTEXT
+    return m_ctx;
+#elif defined(__x86_64__)
+    return (void*)m_ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    return (void*)m_ctx.uc_mcontext.sp;
+#else
+    #error "shared stack fiber is not supported on this architecture"
+#endif
+}
+
+void Fiber::saveStack() {
+    // 栈从高地址向低地址增长, 切出时的栈顶到栈底之间就是用到的部分
+    char* top = (char*)m_stack + m_stacksize;
+    char* sp = (char*)getContextSp();
+    SYLAR_ASSERT(sp >= (char*)m_stack && sp <= top);
+    size_t used = top - sp;
+    // 按实际用量分配, 空闲协程只占用它真正用到的内存
+    if (m_savedCap < used || m_savedCap > used * 2) {
+        free(m_savedStack);
+        m_savedStack = (char*)malloc(used);
+        m_savedCap = used;
+    }
+    memcpy(m_savedStack, sp, used);
+    m_savedSize = used;
+}
+
+void Fiber::restoreStack() {
+    char* top = (char*)m_stack + m_stacksize;
+    memcpy(top - m_savedSize, m_savedStack, m_savedSize);
+}
+
+void Fiber::acquireSharedStack() {
+    SharedStack* ss = GetSharedStack();
+    if (m_thread == -1) {
+        // 第一次运行, 绑定当前线程的共享栈, 之后只能在这个线程上恢复
+        m_thread = sylar::GetThreadId();
+        m_stack = ss->stack;
+        m_stacksize = ss->size;
+    }
+    SYLAR_ASSERT(m_thread == sylar::GetThreadId());
+    if (m_state == INIT) {
+        ++ss->bound;
+    }
+    if (ss->occupant == this) {
+        return ;
+    }
+    // 先把占用者的数据拷贝出去
+    if (ss->occupant) {
+        ss->occupant->saveStack();
+    }
+    ss->occupant = this;
+    if (m_state == INIT) {
+        makeContext(&Fiber::MainFunc);
+    } else {
+        restoreStack();
+    }
+}
+
+void Fiber::releaseSharedStack() {
+    // 运行结束的协程不需要保存栈数据
+    SharedStack* ss = GetSharedStack();
+    if (ss->occupant == this) {
+        ss->occupant = nullptr;
+    }
+    --ss->bound;
+    m_savedSize = 0;
+}
+
+size_t Fiber::GetBoundFiberCount() {
+    return t_shared_stack.bound;
 }
 
 // 个人理解, 一个是用于单个线程空间内的协程切换, 一个是用于多线程情况下的调度器协程切换
@@ -123,9 +385,7 @@ void Fiber::call() {
     // 切换上下文执行, 
     // 将当前上下文保存至 t_threadFiber->m_ctx
     // 执行此协程对象的 m_ctx
-    if (swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwitchContext(t_threadFiber.get(), this);
 }
 
 void Fiber::back() {
@@ -133,21 +393,24 @@ void Fiber::back() {
     SetThis(t_threadFiber.get());
     // 将当前的上下文保存至此协程对象的 m_ctx中
     // 继续执行 t_threadFiber->m_ctx 的上下文
-    if (swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwitchContext(this, t_threadFiber.get());
 }
 
 void Fiber::swapIn() {
     // 设置运行的协程为此协程对象
     SetThis(this);
     SYLAR_ASSERT(m_state != EXEC);
+    // 共享栈协程先换入自己的栈数据, 要在修改状态前判断是否是第一次运行
+    if (m_sharedStack) {
+        acquireSharedStack();
+    }
     // 执行态
     m_state = EXEC;
     // 保存当前上下文至调度器的调度协程
     // 执行此协程对象的上下文
-    if (swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext in");
+    SwitchContext(Scheduler::GetMainFiber(), this);
+    if (m_sharedStack && (m_state == TERM || m_state == EXCEPT)) {
+        releaseSharedStack();
     }
 } 
 
@@ -156,9 +419,7 @@ void Fiber::swapOut() {
     SetThis(Scheduler::GetMainFiber());
     // 保存当前上下文至此协程对象的 m_ctx
     // 继续执行调度器的调度协程的上下文
-    if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwitchContext(this, Scheduler::GetMainFiber());
 }
 // 设置运行的协程为 Fiber* f
 void Fiber::SetThis(Fiber *f) {
@@ -179,6 +440,31 @@ Fiber::ptr Fiber::GetThis() {
     // 返回创建的协程, 也就是当前运行中的协程
     return t_fiber->shared_from_this();
 }
+bool Fiber::acquireRun(Scheduler* scheduler, int thread, int prio) {
+    uint8_t state = m_runState.load(std::memory_order_acquire);
+    while (true) {
+        if (state == RUN_IDLE) {
+            if (m_runState.compare_exchange_weak(state, RUN_BUSY
+                        , std::memory_order_acquire)) {
+                return true;
+            }
+            continue;
+        }
+        // 原线程还在处理切出, 转交给它, 失败说明它刚好处理完, 重新尝试占用
+        m_wakeScheduler = scheduler;
+        m_wakeThread = thread;
+        m_wakePrio = prio;
+        if (m_runState.compare_exchange_weak(state, RUN_WAKE
+                    , std::memory_order_release)) {
+            return false;
+        }
+    }
+}
+
+bool Fiber::releaseRun() {
+    return m_runState.exchange(RUN_IDLE, std::memory_order_acq_rel) == RUN_WAKE;
+}
+
 // 将当前运行的协程切换至就绪态
 void Fiber::YieldToReady() {
     Fiber::ptr cur = GetThis();
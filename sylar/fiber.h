@@ -3,8 +3,14 @@
 
 #include <memory>
 #include <functional>
-#include <ucontext.h>
+#include <atomic>
 #include "thread.h"
+#include "fiber_context.h"
+#include "task.h"
+
+#if !SYLAR_FIBER_ASM_CONTEXT
+#include <ucontext.h>
+#endif
 
 namespace sylar {
 
@@ -30,12 +36,14 @@ private:
     // 不带参的构造, 用于记录主线程的上下文(main函数的)
     Fiber();
 public:
-    // 需要运行的函数, 栈大小, 是否将主线程也加入调度
-    Fiber(std::function<void()> cb, size_t stacksize = 0, 
-            bool use_caller = false);
+    // 需要运行的函数, 栈大小(0 表示使用默认大小), 是否将主线程也加入调度
+    // shared_stack 为 true 时在线程的共享栈上运行, 切出后只保存用到的那部分栈
+    // 共享栈协程第一次运行后就绑定在该线程上, 不支持 use_caller
+    Fiber(Task cb, size_t stacksize = 0, 
+            bool use_caller = false, bool shared_stack = false);
     ~Fiber();
     // 重新绑定协程需要执行的函数
-    void reset(std::function<void()> cb);
+    void reset(Task cb);
     // 普通的协程使用 swapIn 和 swapOut, 由调度器进行管理
     // 切换进协程的上下文执行
     void swapIn();
@@ -51,6 +59,12 @@ public:
     uint64_t getId() const { return m_id;}
     // 获取此协程对象的状态
     State getState() const { return m_state;}
+    // 协程的栈大小, 共享栈协程在第一次运行前为 0
+    uint32_t getStackSize() const { return m_stacksize;}
+    // 是否运行在共享栈上
+    bool isSharedStack() const { return m_sharedStack;}
+    // 协程绑定的线程 id, -1 表示可以在任意线程上恢复
+    int getBoundThread() const { return m_thread;}
 public:
     // 设置当前运行的协程 Fiber* f
     static void SetThis(Fiber* f);
@@ -71,19 +85,72 @@ public:
     static void CallerMainFunc();
     // 获取当前运行协程的 id
     static uint64_t GetFiberId();
+    // 默认的协程栈大小, 由配置 fiber.stack_size 决定
+    static uint32_t GetDefaultStackSize();
+    // 绑定在当前线程共享栈上还没有运行结束的协程数
+    // 不为 0 时线程不能退出, 否则这些协程再也无法恢复
+    static size_t GetBoundFiberCount();
     // 协程状态
     State m_state = INIT;
+private:
+    // 在协程栈上构造入口为 func 的上下文
+    void makeContext(void (*func)());
+    // 保存当前上下文至 from, 切换到 to 的上下文执行
+    static void SwitchContext(Fiber* from, Fiber* to);
+    // 切出时的栈顶
+    void* getContextSp() const;
+    // 把共享栈上用到的部分拷贝到 m_savedStack
+    void saveStack();
+    // 把 m_savedStack 拷贝回共享栈
+    void restoreStack();
+    // 切入前占用线程的共享栈, 必要时换出上一个占用者
+    void acquireSharedStack();
+    // 协程结束后让出共享栈
+    void releaseSharedStack();
+    // 调度器换入前占用协程, 成功返回 true
+    // 协程在切出之前就已经登记到等待队列中, 可能还在切出的过程中就被唤醒, 被其他线程取到
+    // 这时不等原线程, 记下唤醒的调度器, 线程和优先级后返回 false, 由原线程处理完切出后重新调度
+    bool acquireRun(Scheduler* scheduler, int thread, int prio);
+    // 调度器处理完切出的协程后释放, 切出期间被唤醒过返回 true, 调用方按记下的目标重新调度
+    bool releaseRun();
 private:
     // 协程 id
     uint64_t m_id;
     // 协程的栈大小
     uint32_t m_stacksize;
     // 协程的上下文
+#if SYLAR_FIBER_ASM_CONTEXT
+    // 汇编实现下为切出时的栈顶
+    fcontext_t m_ctx = nullptr;
+#else
     ucontext_t m_ctx;
-    // 协程的栈
+#endif
+    // 协程的栈, 共享栈协程指向线程的共享栈
     void* m_stack = nullptr;
+    // 是否运行在共享栈上
+    bool m_sharedStack = false;
+    // 共享栈协程绑定的线程 id
+    int m_thread = -1;
+    // 共享栈协程切出后保存的栈数据
+    char* m_savedStack = nullptr;
+    size_t m_savedSize = 0;
+    size_t m_savedCap = 0;
+    // 调度线程对协程的占用状态
+    enum RunState {
+        // 没有线程在执行或处理切出
+        RUN_IDLE = 0,
+        // 某个线程正在执行或处理切出
+        RUN_BUSY = 1,
+        // 处理切出期间被其他线程取到, 等原线程重新调度
+        RUN_WAKE = 2,
+    };
+    std::atomic<uint8_t> m_runState = {RUN_IDLE};
+    // RUN_WAKE 时重新调度的目标, 由取到协程的线程在设置 RUN_WAKE 之前写入
+    Scheduler* m_wakeScheduler = nullptr;
+    int m_wakeThread = -1;
+    int m_wakePrio = 0;
     // 协程需要执行的函数(上下文的入口函数)
-    std::function<void()> m_cb;
+    Task m_cb;
 };
 
 }
@@ -0,0 +1,134 @@
+#include "fiber_context.h"
+#include <stdint.h>
+#include <string.h>
+
+#if SYLAR_HAS_ASM_CONTEXT
+
+extern "C" void sylar_fcontext_entry();
+
+#if defined(__x86_64__)
+// System V x86-64 只需保存 rbx, rbp, r12-r15, 以及 mxcsr 和 x87 控制字
+// 栈布局(从低到高): mxcsr/x87cw(16 字节) r15 r14 r13 r12 rbx rbp 返回地址
+__asm__(
+    ".text\n"
+    ".globl sylar_jump_fcontext\n"
+    ".type sylar_jump_fcontext,@function\n"
+    ".align 16\n"
+    "sylar_jump_fcontext:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $16, %rsp\n"
+    "    stmxcsr 8(%rsp)\n"
+    "    fnstcw 12(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr 8(%rsp)\n"
+    "    fldcw 12(%rsp)\n"
+    "    addq $16, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size sylar_jump_fcontext,.-sylar_jump_fcontext\n"
+    // 新上下文第一次切入时 ret 到这里, r12 中是入口函数
+    ".globl sylar_fcontext_entry\n"
+    ".type sylar_fcontext_entry,@function\n"
+    ".align 16\n"
+    "sylar_fcontext_entry:\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    ".size sylar_fcontext_entry,.-sylar_fcontext_entry\n"
+);
+
+namespace sylar {
+
+fcontext_t make_fcontext(void* stack, size_t size, void (*func)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    // 返回地址放在 16 字节对齐减 8 的位置, ret 之后 rsp 16 字节对齐, 
+    // 入口桩再 call 入口函数时满足调用约定
+    uint64_t* sp = (uint64_t*)(top - 24 - 64);
+    memset(sp, 0, 64);
+    uint32_t mxcsr;
+    uint16_t x87cw;
+    __asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+    __asm__ volatile("fnstcw %0" : "=m"(x87cw));
+    memcpy((char*)sp + 8, &mxcsr, sizeof(mxcsr));
+    memcpy((char*)sp + 12, &x87cw, sizeof(x87cw));
+    sp[5] = (uint64_t)func;                    // r12
+    sp[7] = 0;                                 // rbp, 栈回溯到此结束
+    sp[8] = (uint64_t)&sylar_fcontext_entry;   // 返回地址
+    return sp;
+}
+
+}
+
+#elif defined(__aarch64__)
+// AAPCS64 只需保存 x19-x29, lr(x30) 和 d8-d15
+// 栈布局(从低到高): x19-x28 x29 x30 d8-d15, 共 160 字节
+__asm__(
+    ".text\n"
+    ".globl sylar_jump_fcontext\n"
+    ".type sylar_jump_fcontext,%function\n"
+    ".align 4\n"
+    "sylar_jump_fcontext:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size sylar_jump_fcontext,.-sylar_jump_fcontext\n"
+    // 新上下文第一次切入时 ret 到这里, x19 中是入口函数
+    ".globl sylar_fcontext_entry\n"
+    ".type sylar_fcontext_entry,%function\n"
+    ".align 4\n"
+    "sylar_fcontext_entry:\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size sylar_fcontext_entry,.-sylar_fcontext_entry\n"
+);
+
+namespace sylar {
+
+fcontext_t make_fcontext(void* stack, size_t size, void (*func)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t* sp = (uint64_t*)(top - 160);
+    memset(sp, 0, 160);
+    sp[0] = (uint64_t)func;                    // x19
+    sp[10] = 0;                                // x29, 栈回溯到此结束
+    sp[11] = (uint64_t)&sylar_fcontext_entry;  // x30
+    return sp;
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __SYLAR_FIBER_CONTEXT_H__
+#define __SYLAR_FIBER_CONTEXT_H__
+
+#include <stddef.h>
+
+// 当前架构是否有手写汇编的上下文切换实现
+#if defined(__x86_64__) || defined(__aarch64__)
+    #define SYLAR_HAS_ASM_CONTEXT 1
+#else
+    #define SYLAR_HAS_ASM_CONTEXT 0
+#endif
+
+// 协程是否使用汇编实现的上下文切换, 由编译选项 SYLAR_FIBER_ASM 打开
+// 不支持的架构自动退回 ucontext
+#if defined(SYLAR_FIBER_ASM) && SYLAR_HAS_ASM_CONTEXT
+    #define SYLAR_FIBER_ASM_CONTEXT 1
+#else
+    #define SYLAR_FIBER_ASM_CONTEXT 0
+#endif
+
+namespace sylar {
+
+// 汇编实现的上下文就是切出时的栈顶指针, 被调用者保存的寄存器都压在栈上
+typedef void* fcontext_t;
+
+#if SYLAR_HAS_ASM_CONTEXT
+// 在 [stack, stack + size) 上构造一个入口为 func 的上下文
+// func 不能返回, 结束时需要切换到其他上下文
+fcontext_t make_fcontext(void* stack, size_t size, void (*func)());
+#endif
+
+}
+
+#if SYLAR_HAS_ASM_CONTEXT
+extern "C" {
+// 把被调用者保存的寄存器压栈, 栈顶写入 *from, 再切换到 to 并恢复它的寄存器
+// 不经过信号屏蔽字相关的系统调用
+void sylar_jump_fcontext(sylar::fcontext_t* from, sylar::fcontext_t to);
+}
+#endif
+
+#endif
@@ -0,0 +1,142 @@
+#include "fiber_sync.h"
+#include "scheduler.h"
+#include "macro.h"
+
+namespace sylar {
+
+void FiberWaitQueue::push() {
+    Scheduler* scheduler = Scheduler::GetThis();
+    SYLAR_ASSERT(scheduler);
+    m_waiters.push_back({scheduler, Fiber::GetThis()});
+}
+
+void FiberWaitQueue::park(Spinlock::Lock& lock) {
+    push();
+    lock.unlock();
+    // 队列持有协程的引用, 唤醒前不会被释放
+    Fiber::YieldToHold();
+}
+
+bool FiberWaitQueue::wakeOne(Spinlock::Lock& lock) {
+    if (m_waiters.empty()) {
+        return false;
+    }
+    Waiter waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    lock.unlock();
+    Wake(waiter);
+    return true;
+}
+
+size_t FiberWaitQueue::wakeAll(Spinlock::Lock& lock) {
+    std::list<Waiter> waiters;
+    waiters.swap(m_waiters);
+    lock.unlock();
+    for (auto& i : waiters) {
+        Wake(i);
+    }
+    return waiters.size();
+}
+
+void FiberWaitQueue::Wake(Waiter& waiter) {
+    // 共享栈协程只能回到绑定的线程
+    int thread = waiter.fiber->getBoundThread();
+    waiter.scheduler->schedule(std::move(waiter.fiber), thread);
+}
+
+void FiberMutex::lock() {
+    Spinlock::Lock lock(m_mutex);
+    if (!m_locked) {
+        m_locked = true;
+        return ;
+    }
+    // 醒来时锁已经交给了自己
+    m_waiters.park(lock);
+}
+
+bool FiberMutex::tryLock() {
+    Spinlock::Lock lock(m_mutex);
+    if (m_locked) {
+        return false;
+    }
+    m_locked = true;
+    return true;
+}
+
+void FiberMutex::unlock() {
+    Spinlock::Lock lock(m_mutex);
+    SYLAR_ASSERT(m_locked);
+    // 交给等待者时保持加锁状态, 其他协程不能插队
+    if (!m_waiters.wakeOne(lock)) {
+        m_locked = false;
+    }
+}
+
+void FiberCondition::wait(FiberMutex::Lock& lock) {
+    Spinlock::Lock l(m_mutex);
+    m_waiters.push();
+    l.unlock();
+    // 入队之后才释放互斥量, 之后的 notify 一定能找到自己, 通知不会丢
+    lock.unlock();
+    Fiber::YieldToHold();
+    lock.lock();
+}
+
+void FiberCondition::notify() {
+    Spinlock::Lock lock(m_mutex);
+    m_waiters.wakeOne(lock);
+}
+
+void FiberCondition::notifyAll() {
+    Spinlock::Lock lock(m_mutex);
+    m_waiters.wakeAll(lock);
+}
+
+FiberSemaphore::FiberSemaphore(uint32_t count)
+    :m_count(count) {
+}
+
+void FiberSemaphore::wait() {
+    Spinlock::Lock lock(m_mutex);
+    if (m_count > 0) {
+        --m_count;
+        return ;
+    }
+    // notify 直接唤醒而不增加计数, 醒来时已经得到了信号
+    m_waiters.park(lock);
+}
+
+bool FiberSemaphore::tryWait() {
+    Spinlock::Lock lock(m_mutex);
+    if (m_count == 0) {
+        return false;
+    }
+    --m_count;
+    return true;
+}
+
+void FiberSemaphore::notify() {
+    Spinlock::Lock lock(m_mutex);
+    if (!m_waiters.wakeOne(lock)) {
+        ++m_count;
+    }
+}
+
+void WaitGroup::add(int64_t delta) {
+    Spinlock::Lock lock(m_mutex);
+    m_count += delta;
+    SYLAR_ASSERT(m_count >= 0);
+    if (m_count == 0) {
+        m_waiters.wakeAll(lock);
+    }
+}
+
+void WaitGroup::wait() {
+    Spinlock::Lock lock(m_mutex);
+    if (m_count == 0) {
+        return ;
+    }
+    m_waiters.park(lock);
+}
+
+}
@@ -0,0 +1,109 @@
+#ifndef __SYLAR_FIBER_SYNC_H__
+#define __SYLAR_FIBER_SYNC_H__
+
+#include <list>
+#include <stdint.h>
+#include "mutex.h"
+#include "noncopyable.h"
+#include "fiber.h"
+
+namespace sylar {
+
+class Scheduler;
+
+// 协程级的同步原语
+// Mutex 等会阻塞整个线程, 持有时做了 hook 的 IO 会让同一线程上的其他协程都停下来
+// 这里等待时只挂起当前协程, 线程继续执行其他任务, 唤醒时把协程交回原来的调度器
+// 等待只能在调度器中运行的协程里调用, 唤醒可以在任意线程调用
+// 内部用 Spinlock 保护, 临界区只有几次链表操作
+
+// 挂起的协程队列, 调用方持有保护它的 Spinlock
+// 唤醒时在锁内取出协程, 释放锁之后再交给调度器
+// 调度可能写 eventfd 唤醒空闲线程, 持有自旋锁做系统调用时被抢占, 其他线程会空转整个时间片
+class FiberWaitQueue : Noncopyable {
+public:
+    // 当前协程入队, 不挂起
+    void push();
+    // 当前协程入队, 释放 lock 后挂起, 被唤醒时不再持有 lock
+    // 释放之后挂起之前就可能被唤醒, 调度器会等协程切出后再换入
+    void park(Spinlock::Lock& lock);
+    // 唤醒最早入队的协程, 唤醒时释放 lock
+    // 队列为空时返回 false, 此时仍持有 lock
+    bool wakeOne(Spinlock::Lock& lock);
+    // 唤醒所有协程并释放 lock, 返回唤醒的个数
+    size_t wakeAll(Spinlock::Lock& lock);
+    bool empty() const { return m_waiters.empty(); }
+private:
+    struct Waiter {
+        Scheduler* scheduler;
+        Fiber::ptr fiber;
+    };
+    static void Wake(Waiter& waiter);
+private:
+    std::list<Waiter> m_waiters;
+};
+
+// 协程互斥量, 不可重入
+// 解锁时有等待者则直接把锁交给最早等待的协程, 按等待顺序获得锁
+class FiberMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    void lock();
+    // 锁被占用时立即返回 false
+    bool tryLock();
+    void unlock();
+private:
+    Spinlock m_mutex;
+    bool m_locked = false;
+    FiberWaitQueue m_waiters;
+};
+
+// 协程条件变量, 和 FiberMutex 一起使用
+class FiberCondition : Noncopyable {
+public:
+    // lock 持有 FiberMutex, 等待期间释放, 返回前重新获得
+    // 和 std::condition_variable 一样, 醒来后需要重新检查条件
+    void wait(FiberMutex::Lock& lock);
+    void notify();
+    void notifyAll();
+private:
+    Spinlock m_mutex;
+    FiberWaitQueue m_waiters;
+};
+
+// 协程信号量
+class FiberSemaphore : Noncopyable {
+public:
+    FiberSemaphore(uint32_t count = 0);
+
+    // count > 0 时 count--, 否则挂起等待
+    void wait();
+    // count 为 0 时立即返回 false
+    bool tryWait();
+    // 有等待者时直接唤醒一个, 否则 count++
+    void notify();
+    uint32_t getCount() const { return m_count; }
+private:
+    Spinlock m_mutex;
+    uint32_t m_count;
+    FiberWaitQueue m_waiters;
+};
+
+// 等待一组任务完成
+// 启动任务前 add, 每个任务结束时 done, wait 挂起到计数归零
+class WaitGroup : Noncopyable {
+public:
+    void add(int64_t delta = 1);
+    void done() { add(-1); }
+    void wait();
+    int64_t getCount() const { return m_count; }
+private:
+    Spinlock m_mutex;
+    int64_t m_count = 0;
+    FiberWaitQueue m_waiters;
+};
+
+}
+
+#endif
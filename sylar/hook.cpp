@@ -9,11 +9,20 @@
 #include "macro.h"
 #include "log.h"
 
+// 每次 IO 都会经过的调试输出, 定义 SYLAR_HOOK_DEBUG 时才编译进来
+#ifdef SYLAR_HOOK_DEBUG
+#define SYLAR_HOOK_TRACE(x) std::cout << x << std::endl
+#else
+#define SYLAR_HOOK_TRACE(x)
+#endif
 
 namespace sylar {
 
 static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout = 
     sylar::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
+// 收发超时定时器的余量, 相近的超时合并触发, 0 为不合并
+static sylar::ConfigVar<int>::ptr g_tcp_timeout_slack = 
+    sylar::Config::Lookup("tcp.timeout.slack", 0, "slack of tcp send/recv timeout timers, ms");
 
 static thread_local bool t_hook_enable = false;
 
@@ -52,16 +61,23 @@ void hook_init() {
 }
 
 static uint64_t s_connect_timeout = -1;
+static uint64_t s_timeout_slack = 0;
 struct _HookIniter {
     _HookIniter() {
         hook_init();
         s_connect_timeout = g_tcp_connect_timeout->getValue();
+        s_timeout_slack = g_tcp_timeout_slack->getValue();
 
         g_tcp_connect_timeout->addListener([](const int& old_value, const int& new_value){
             std::cout << "tcp connect timeout changed from " 
                     << old_value << " to " << new_value << std::endl;
             s_connect_timeout = new_value;
         });
+        g_tcp_timeout_slack->addListener([](const int& old_value, const int& new_value){
+            std::cout << "tcp timeout slack changed from " 
+                    << old_value << " to " << new_value << std::endl;
+            s_timeout_slack = new_value;
+        });
     }
 };
 
@@ -78,19 +94,46 @@ void set_hook_enable(bool flag) {
 }
 
 
-struct timer_info {
-    int cancelled = 0;
-};
+// 把 hook 函数的参数填入 io_uring 请求, 没有对应操作的函数不填写
+static void make_io(sylar::IOManager::IoRequest& req, void* buf, size_t len) {
+    req.buf = buf;
+    req.len = len;
+}
+
+static void make_io(sylar::IOManager::IoRequest& req, const void* buf, size_t len) {
+    req.buf = (void*)buf;
+    req.len = len;
+}
+
+static void make_io(sylar::IOManager::IoRequest& req, void* buf, size_t len, int flags) {
+    make_io(req, buf, len);
+    req.flags = flags;
+}
+
+static void make_io(sylar::IOManager::IoRequest& req, const void* buf, size_t len, int flags) {
+    make_io(req, buf, len);
+    req.flags = flags;
+}
+
+static void make_io(sylar::IOManager::IoRequest& req, sockaddr* addr, socklen_t* addrlen) {
+    req.buf = addr;
+    req.addrlen = addrlen;
+}
+
+template<typename... Args>
+static void make_io(sylar::IOManager::IoRequest& req, Args&&...) {
+    req.op = sylar::IOManager::IO_NONE;
+}
 
 template<typename OriginFun, typename... Args>
-static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
-                uint32_t event, int timeout_so, Args&&... args) {
+static ssize_t do_io(int fd, OriginFun fun, [[maybe_unused]] const char* hook_fun_name,
+                uint32_t event, int timeout_so, sylar::IOManager::IoOp op, Args&&... args) {
     // 未设置, 直接返回
     if (!sylar::t_hook_enable) {
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    std::cout << "do_io<" << hook_fun_name << ">" << std::endl;
+    SYLAR_HOOK_TRACE("do_io<" << hook_fun_name << ">");
 
     // 该 fd 未被管理, 为避免影响调用原函数后 return 
     sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
@@ -110,7 +153,6 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
 
     // 获取对应的时间
     uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
 
 retry:
     // 先尝试调用
@@ -123,46 +165,43 @@ retry:
     if (n == -1 && errno == EAGAIN) {
         // 获取调度器
         sylar::IOManager* iom = sylar::IOManager::GetThis();
-        sylar::Timer::ptr timer;
-        // 设置定时器用作条件
-        // 下文中, 若能重新获取到定时器则说明调度任务未完成, 于是通过超时函数触发事件
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        // 若设置了超时时间
-        if (to != (uint64_t)-1) {
-            // 添加条件定时器
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event](){
-                // 这里是回调函数
-                auto t = winfo.lock();
-                // 若已取消则返回
-                if (!t || t->cancelled) {
-                    return ;
+        // io_uring 后端直接提交读写, 完成后返回结果, 超时由内核处理
+        if (iom->isUring() && op != sylar::IOManager::IO_NONE) {
+            sylar::IOManager::IoRequest req;
+            req.op = op;
+            make_io(req, std::forward<Args>(args)...);
+            if (req.op != sylar::IOManager::IO_NONE && iom->submitIo(fd, req, to)) {
+                if (req.res >= 0) {
+                    return req.res;
+                }
+                // 被 cancelEvent 取消, 比如 fd 被关闭, 重试时由原函数返回错误
+                if (req.res == -ECANCELED) {
+                    goto retry;
                 }
-                // 设置超时标志
-                t->cancelled = ETIMEDOUT;
-                // 取消事件的同时触发事件
-                iom->cancelEvent(fd, sylar::IOManager::Event(event));
-            }, winfo);
+                if (req.res != -EAGAIN) {
+                    errno = -req.res;
+                    return -1;
+                }
+            }
         }
-        
-        int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
-        // 若 addEvent 失败, 取消定时器
+        // 添加事件的同时设置超时, 超时后取消事件并唤醒协程
+        // 定时器保存在 fd 的上下文中, 反复等待时复用, 不再为每次等待分配定时器和回调
+        int rt = iom->addTimedEvent(fd, (sylar::IOManager::Event)(event)
+                                    , to, sylar::s_timeout_slack);
+        // 持久注册模式下事件已经就绪, 不用挂起
+        if (rt == 1) {
+            goto retry;
+        }
+        // 若 addEvent 失败, 不会设置定时器
         if (SYLAR_UNLICKLY(rt)) {
-            // std::cout << hook_fun_name << " addEvent (" << fd << ", " << event 
-            // << ")" << std::endl;
-            if (timer) {
-                timer->cancel();
-            }
+            SYLAR_HOOK_TRACE(hook_fun_name << " addEvent (" << fd << ", " << event << ")");
             return -1;
         } else {
             // 进入等待态
             sylar::Fiber::YieldToHold();
-            // 若再回来, 说明 timer 超时了 或者 addEvent 准备就绪了
-            if (timer) {
-                timer->cancel();
-            }
-            if (tinfo->cancelled) {
-                errno = tinfo->cancelled;
+            // 若再回来, 说明超时了 或者事件准备就绪了
+            if (iom->finishTimedEvent(fd, (sylar::IOManager::Event)(event))) {
+                errno = ETIMEDOUT;
                 return -1;
             }
             // 再尝试一次
@@ -228,7 +267,7 @@ int socket(int domain, int type, int protocol) {
     if (fd == -1) {
         return fd;
     }
-    sylar::FdMgr::GetInstance()->get(fd, true);
+    sylar::FdMgr::GetInstance()->create(fd);
     return fd;
 }
 
@@ -250,6 +289,22 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    // io_uring 后端由内核完成连接和超时
+    if (iom && iom->isUring()) {
+        sylar::IOManager::IoRequest req;
+        req.op = sylar::IOManager::IO_CONNECT;
+        req.buf = (void*)addr;
+        req.len = addrlen;
+        if (iom->submitIo(fd, req, timeout_ms)) {
+            if (req.res == 0) {
+                return 0;
+            }
+            errno = -req.res;
+            return -1;
+        }
+    }
+
     int n = connect_f(fd, addr, addrlen);
     if (n == 0) {
         return 0;
@@ -257,36 +312,15 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return n;
     }
 
-    sylar::IOManager* iom = sylar::IOManager::GetThis();
-    sylar::Timer::ptr timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    if (timeout_ms != (uint64_t)-1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom](){
-            auto t = winfo.lock();
-            if (!t || t->cancelled) {
-                return ;
-            }
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, sylar::IOManager::WRITE);
-        }, winfo);
-    }
-
-    int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
+    int rt = iom->addTimedEvent(fd, sylar::IOManager::WRITE, timeout_ms);
+    // rt 为 1 时已经可写, 直接检查连接结果
     if (rt == 0) {
         sylar::Fiber::YieldToHold();
-        if (timer) {
-            timer->cancel();
-        }
-        if (tinfo->cancelled) {
-            errno = tinfo->cancelled;
+        if (iom->finishTimedEvent(fd, sylar::IOManager::WRITE)) {
+            errno = ETIMEDOUT;
             return -1;
         }
-    } else {
-        if (timer) {
-            timer->cancel();
-        }
+    } else if (rt != 1) {
         std::cout << "connect addEvent(" << fd << ", WRITE) error" << std::endl;
     }
 
@@ -309,53 +343,53 @@ int connect(int sockfd, const struct sockaddr *addr,
 }
 
 int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    int fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, sylar::IOManager::IO_ACCEPT, addr, addrlen);
     if (fd >= 0) {
-        sylar::FdMgr::GetInstance()->get(fd, true);
+        sylar::FdMgr::GetInstance()->create(fd);
     }
     return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
-    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, sylar::IOManager::IO_READ, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, sylar::IOManager::IO_NONE, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, sylar::IOManager::IO_RECV, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                 struct sockaddr *src_addr, socklen_t *addrlen) {
-    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, sylar::IOManager::IO_NONE, buf, len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
+    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, sylar::IOManager::IO_NONE, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, sylar::IOManager::IO_WRITE, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {    
-    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, sylar::IOManager::IO_NONE, iov, iovcnt);
 }
 
 ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
-    return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags);
+    return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, sylar::IOManager::IO_SEND, buf, len, flags);
 }
 
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
               const struct sockaddr *dest_addr, socklen_t addrlen) {
-    return do_io(sockfd, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags, dest_addr, addrlen);
+    return do_io(sockfd, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, sylar::IOManager::IO_NONE, buf, len, flags, dest_addr, addrlen);
 }
 
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
-    return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, sylar::IOManager::IO_NONE, msg, flags);
 }
 
 int close(int fd) {
@@ -17,6 +17,7 @@ std::string HttpResult::toString() const {
 
 HttpConnection::HttpConnection(Socket::ptr sock, bool owner)
         :SocketStream(sock, owner) {
+    m_createTime = sylar::GetCoarseMS();
 }
 
 HttpConnection::~HttpConnection() {
@@ -282,7 +283,7 @@ HttpConnectionPool::HttpConnectionPool(const std::string& host
 }
     
 HttpConnection::ptr HttpConnectionPool::getConnection() {
-    uint64_t now_ms = sylar::GetCurrentMS();
+    uint64_t now_ms = sylar::GetCoarseMS();
     std::vector<HttpConnection*> invalid_conns;
     HttpConnection* ptr = nullptr;
     MutexType::Lock lock(m_mutex);
@@ -294,7 +295,7 @@ HttpConnection::ptr HttpConnectionPool::getConnection() {
             invalid_conns.push_back(conn);
             continue;
         }
-        if ((conn->m_createTime + m_maxAliveTime) > now_ms) {
+        if ((conn->m_createTime + m_maxAliveTime) <= now_ms) {
             invalid_conns.push_back(conn);
             continue;
         }
@@ -335,7 +336,7 @@ void HttpConnectionPool::ReleasePtr(HttpConnection* ptr, HttpConnectionPool* poo
     ++ptr->m_request;
     // 未连接, 超时, 超过最大连接数 
     if (!ptr->isConnected()
-            || ptr->m_createTime + pool->m_maxAliveTime >= sylar::GetCurrentMS()
+            || ptr->m_createTime + pool->m_maxAliveTime <= sylar::GetCoarseMS()
             || ptr->m_request >= pool->m_maxRequest) {
         delete ptr;
         --pool->m_total;
@@ -87,6 +87,7 @@ public:
     HttpResponse::ptr recvResponse();
     int sendRequest(HttpRequest::ptr req);
 private:
+    // 创建时间, 缓存的单调时钟
     uint64_t m_createTime = 0;
     uint64_t m_request = 0;
 };
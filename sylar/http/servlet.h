@@ -26,6 +26,8 @@ public:
                         , sylar::http::HttpResponse::ptr response
                         , sylar::http::HttpSession::ptr session) = 0;
     const std::string& getName() const { return m_name; }
+    // 当前线程缓存的单调时钟(毫秒), 计算耗时和过期时使用, 不需要每次读系统时钟
+    static uint64_t GetNowMS() { return sylar::GetCoarseMS(); }
 protected:
     std::string m_name;
 };
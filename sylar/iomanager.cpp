@@ -1,14 +1,71 @@
 #include "iomanager.h"
 #include "log.h"
 #include "macro.h"
+#include "config.h"
+#include "util.h"
+#include "fd_manager.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 
 namespace sylar {
+// 按调度器名称开启分片模式, 覆盖构造时的参数
+static ConfigVar<std::map<std::string, bool> >::ptr g_iomanager_sharded =
+    Config::Lookup("iomanager.sharded", std::map<std::string, bool>()
+            , "one epoll per worker thread, by iomanager name");
+// 按调度器名称开启 epoll 持久注册模式
+static ConfigVar<std::map<std::string, bool> >::ptr g_iomanager_persistent =
+    Config::Lookup("iomanager.persistent", std::map<std::string, bool>()
+            , "keep fds registered in epoll with EPOLLET, by iomanager name");
+// 按调度器名称选择 epoll 或 io_uring, 覆盖构造时的参数
+static ConfigVar<std::map<std::string, std::string> >::ptr g_iomanager_backend =
+    Config::Lookup("iomanager.backend", std::map<std::string, std::string>()
+            , "epoll or io_uring, by iomanager name");
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+    Config::Lookup("iomanager.uring_entries", (uint32_t)256
+            , "submission queue size of each io_uring");
+// 工作线程自己的请求攒够这么多个, 或者经过这么多个任务之后提交一次, 空闲时全部提交
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_batch =
+    Config::Lookup("iomanager.uring_batch", (uint32_t)32
+            , "batch size of io_uring submissions");
+// 一次 epoll_wait 最多返回的事件数
+static ConfigVar<uint32_t>::ptr g_iomanager_epoll_batch =
+    Config::Lookup("iomanager.epoll_batch", (uint32_t)256
+            , "max events returned by one epoll_wait");
+// 按调度器名称配置阻塞之前的忙轮询时间, 微秒, 用 CPU 换延迟
+static ConfigVar<std::map<std::string, uint32_t> >::ptr g_iomanager_busy_poll_us =
+    Config::Lookup("iomanager.busy_poll_us", std::map<std::string, uint32_t>()
+            , "spin on epoll_wait for this long before blocking, by iomanager name");
+// epoll_event.data 中 waker 指针的标记位, 用于和 FdContext 指针区分
+static const uint64_t s_waker_tag = 0x1;
+
+// io_uring 完成事件的 user_data: 低 3 位为类型, 高 16 位为请求序号, 中间为指针
+// 取消请求和链接的超时的 user_data 为 0, 完成事件直接忽略
+static const uint64_t s_uring_poll_read = 0x2;
+static const uint64_t s_uring_poll_write = 0x3;
+static const uint64_t s_uring_io_read = 0x4;
+static const uint64_t s_uring_io_write = 0x5;
+static const uint64_t s_uring_kind_mask = 0x7;
+static const int s_uring_gen_shift = 48;
+static const uint64_t s_uring_ptr_mask = ((1ull << s_uring_gen_shift) - 1) & ~s_uring_kind_mask;
+
+static uint64_t UringData(void* ptr, uint64_t kind, uint16_t gen) {
+    SYLAR_ASSERT(((uint64_t)ptr & ~s_uring_ptr_mask) == 0);
+    return (uint64_t)ptr | kind | ((uint64_t)gen << s_uring_gen_shift);
+}
+
+// FdContext 表容量的上限, RLIMIT_NOFILE 为无限时使用
+static const uint64_t s_max_fd_contexts = 1 << 24;
+
+// 当前线程自己的 io_uring 中攒着请求时, 已经执行过的任务数
+static thread_local uint32_t t_uring_tasks = 0;
+
 // 根据指定事件返回上下文
 IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
     switch (event) {
@@ -23,9 +80,12 @@ void IOManager::FdContext::resetContext(EventContext& ctx) {
     ctx.cb = nullptr;
     ctx.fiber.reset();
     ctx.scheduler = nullptr;
+    ctx.thread = -1;
+    ctx.ring = nullptr;
+    ctx.request = nullptr;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event){
+void IOManager::FdContext::triggerEvent(IOManager::Event event, bool local){
     // 确保当前有此类型事件
     SYLAR_ASSERT(events & event);
     // 取消存储的事件, 因为即将触发
@@ -33,82 +93,295 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event){
     // 获取指定事件的上下文
     EventContext& ctx = getContext(event);
     // 有函数调度函数, 没函数调度协程
+    // 反应器线程唤醒的任务优先交给本线程的就绪列表, 不经过公共队列
     if (ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
+        if (!local || !ctx.scheduler->scheduleLocal(&ctx.cb, ctx.thread)) {
+            ctx.scheduler->schedule(&ctx.cb, ctx.thread);
+        }
     } else {
-        ctx.scheduler->schedule(&ctx.fiber);
+        if (!local || !ctx.scheduler->scheduleLocal(&ctx.fiber, ctx.thread)) {
+            ctx.scheduler->schedule(&ctx.fiber, ctx.thread);
+        }
     }
     // 调度完毕, 退出
     ctx.scheduler = nullptr;
+    ctx.thread = -1;
+    ctx.ring = nullptr;
+    ctx.request = nullptr;
     return ;
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string name) 
-    :Scheduler(threads, use_caller, name) {
-    m_epfd = epoll_create(5000);
-    SYLAR_ASSERT(m_epfd > 0);
+IOManager::IOManager(size_t threads, bool use_caller, const std::string name
+                    , bool work_stealing, bool sharded, Backend backend) 
+    :Scheduler(threads, use_caller, name, work_stealing)
+    ,m_sharded(sharded)
+    ,m_backend(backend) {
+    // use_caller 时根线程只在 stop 中参与调度, 不拥有 fd, 只有它一个工作线程时例外
+    m_shardCount = use_caller && threads > 1 ? threads - 1 : threads;
+    auto shardeds = g_iomanager_sharded->getValue();
+    auto it = shardeds.find(getName());
+    if (it != shardeds.end()) {
+        m_sharded = it->second;
+    }
+    auto backends = g_iomanager_backend->getValue();
+    auto bit = backends.find(getName());
+    if (bit != backends.end()) {
+        m_backend = bit->second == "io_uring" ? IO_URING : EPOLL;
+    }
+    m_uringBatch = g_iomanager_uring_batch->getValue();
+    m_epollBatch = std::max<uint32_t>(g_iomanager_epoll_batch->getValue(), 1);
+    auto busy_polls = g_iomanager_busy_poll_us->getValue();
+    auto bpit = busy_polls.find(getName());
+    if (bpit != busy_polls.end()) {
+        m_busyPollUs = bpit->second;
+    }
 
-    int rt = pipe(m_tickleFds);
-    SYLAR_ASSERT(!rt);
+    // 每个工作线程一个 io_uring, 有一个创建失败就退回 epoll
+    std::vector<IoUring*> rings;
+    if (m_backend == IO_URING) {
+        for (size_t i = 0; i < getMaxWorkerCount(); ++i) {
+            IoUring* ring = new IoUring;
+            rings.push_back(ring);
+            if (!ring->init(g_iomanager_uring_entries->getValue())) {
+                std::cout << "name=" << getName() 
+                    << " io_uring is not available, use epoll" << std::endl;
+                for (auto i : rings) {
+                    delete i;
+                }
+                rings.clear();
+                m_backend = EPOLL;
+                break;
+            }
+        }
+    }
+    // io_uring 的 poll 是单次的, 只有 epoll 后端可以持久注册
+    auto persistents = g_iomanager_persistent->getValue();
+    auto pit = persistents.find(getName());
+    m_persistent = m_backend == EPOLL && pit != persistents.end() && pit->second;
+    if (m_backend == EPOLL && !m_sharded) {
+        m_epfd = epoll_create(5000);
+        SYLAR_ASSERT(m_epfd > 0);
+    }
 
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event));
-    // 读事件, 边缘触发
-    event.events = EPOLLIN | EPOLLET;
-    // 将管道读端加入监听, 其他线程向管道写数据时, epoll会通知iomanager
-    // 设置管道的作用是用于唤醒 epoll
-    event.data.fd = m_tickleFds[0];
-    
-    // 管道读端设置为非阻塞模式
-    // fcntl 系统调用设置
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    SYLAR_ASSERT(!rt);
-    // 使用epoll_ctl将管道读加入epoll实例中
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    SYLAR_ASSERT(!rt);
+    // 每个工作线程一个 eventfd
+    // 非分片模式下都加入同一个 epoll, 一次写入只会让一个阻塞在 epoll_wait 中的线程返回, 不会惊群
+    // 不同线程的 eventfd 互不合并, 连续入队多个任务可以唤醒多个线程
+    // 分片模式下每个线程的 eventfd 加入自己的 epoll
+    // io_uring 后端下每个线程在自己的 io_uring 中 poll 自己的 eventfd
+    // 弹性模式下为之后可能增加的线程预留 eventfd, 弹性线程的 epoll 中只有 eventfd
+    for (size_t i = 0; i < getMaxWorkerCount(); ++i) {
+        Waker* waker = new Waker;
+        waker->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(waker->fd >= 0);
+        m_wakers.push_back(waker);
+        if (m_backend == IO_URING) {
+            waker->ring = rings[i];
+            armWaker(waker);
+            continue;
+        }
+        waker->epfd = m_sharded ? epoll_create(5000) : m_epfd;
+        SYLAR_ASSERT(waker->epfd > 0);
+
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        // 读事件, 边缘触发
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = (uint64_t)waker | s_waker_tag;
+        int rt = epoll_ctl(waker->epfd, EPOLL_CTL_ADD, waker->fd, &event);
+        SYLAR_ASSERT(!rt);
+    }
 
-    // 在这里初始化fdContexts
-    contextResize(32);
+    // 按进程能打开的最多 fd 数分配 FdContext 表的第一级
+    // 用硬限制, 运行中调高软限制之后的 fd 也能放下
+    uint64_t max_fds = s_max_fd_contexts;
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY) {
+        max_fds = std::min<uint64_t>(rl.rlim_max, s_max_fd_contexts);
+    }
+    m_fdChunkCount = (max_fds + FD_CHUNK_SIZE - 1) / FD_CHUNK_SIZE;
+    m_fdChunks = new std::atomic<FdContext*>[m_fdChunkCount];
+    for (size_t i = 0; i < m_fdChunkCount; ++i) {
+        m_fdChunks[i] = nullptr;
+    }
 
+    // 每个工作线程一个定时器分片
+    initTimerShards(getMaxWorkerCount());
     start();
 }
 
 IOManager::~IOManager() {
     stop();
-    close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    if (m_epfd != -1) {
+        close(m_epfd);
+    }
+    for (auto waker : m_wakers) {
+        if (m_sharded && waker->epfd != -1) {
+            close(waker->epfd);
+        }
+        if (waker->ring) {
+            delete waker->ring;
+        }
+        close(waker->fd);
+        delete waker;
+    }
+
+    for (size_t i = 0; i < m_fdChunkCount; ++i) {
+        delete[] m_fdChunks[i].load();
+    }
+    delete[] m_fdChunks;
+}
 
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (m_fdContexts[i]) {
-            delete m_fdContexts[i];
+IOManager::FdContext* IOManager::getFdContext(int fd, bool auto_create) {
+    size_t index = (size_t)fd >> FD_CHUNK_SHIFT;
+    if (SYLAR_UNLICKLY(fd < 0 || index >= m_fdChunkCount)) {
+        return nullptr;
+    }
+    FdContext* chunk = m_fdChunks[index].load(std::memory_order_acquire);
+    if (SYLAR_UNLICKLY(!chunk)) {
+        if (!auto_create) {
+            return nullptr;
+        }
+        FdContext* new_chunk = new FdContext[FD_CHUNK_SIZE];
+        for (int i = 0; i < FD_CHUNK_SIZE; ++i) {
+            new_chunk[i].fd = (index << FD_CHUNK_SHIFT) + i;
         }
+        // 其他线程可能已经装入, 用它的
+        if (m_fdChunks[index].compare_exchange_strong(chunk, new_chunk
+                    , std::memory_order_acq_rel)) {
+            chunk = new_chunk;
+        } else {
+            delete[] new_chunk;
+        }
+    }
+    return &chunk[fd & (FD_CHUNK_SIZE - 1)];
+}
+
+size_t IOManager::selectShard(int fd) {
+    // 弹性线程会退出, 根线程平时不运行调度, 都不拥有 fd, 和非工作线程一样按 fd 分配
+    int index = GetWorkerIndex();
+    if (Scheduler::GetThis() != this || index < 0 || index >= (int)m_shardCount) {
+        index = fd % m_shardCount;
+    }
+    return index;
+}
+
+int IOManager::selectEpoll(int fd) {
+    if (!m_sharded) {
+        return m_epfd;
+    }
+    return m_wakers[selectShard(fd)]->epfd;
+}
+
+IoUring* IOManager::selectRing(int fd) {
+    return m_wakers[selectShard(fd)]->ring;
+}
+
+void IOManager::submitRing(IoUring* ring) {
+    int index = GetWorkerIndex();
+    bool own = Scheduler::GetThis() == this && index >= 0 
+                && index < (int)m_wakers.size() && m_wakers[index]->ring == ring;
+    // 其他线程可能阻塞在等待中, 不会替我们提交
+    if (!own || ring->getUnsubmitted() >= m_uringBatch) {
+        ring->submit();
     }
 }
 
-void IOManager::contextResize(size_t size) {
-    m_fdContexts.resize(size);
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (!m_fdContexts[i]) {
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
+void IOManager::onTaskYield() {
+    if (m_backend != IO_URING) {
+        return ;
+    }
+    int index = GetWorkerIndex();
+    if (index < 0 || index >= (int)m_wakers.size()) {
+        return ;
+    }
+    // 线程一直有任务执行时不会进入空闲, 经过一批任务后提交攒下的请求
+    IoUring* ring = m_wakers[index]->ring;
+    IoUring::MutexType::Lock lock(ring->getMutex());
+    if (!ring->getUnsubmitted()) {
+        t_uring_tasks = 0;
+        return ;
+    }
+    if (++t_uring_tasks >= m_uringBatch) {
+        ring->submit();
+        t_uring_tasks = 0;
+    }
+}
+
+void IOManager::armWaker(Waker* waker) {
+    IoUring::MutexType::Lock lock(waker->ring->getMutex());
+    io_uring_sqe* sqe = waker->ring->getSqe();
+    SYLAR_ASSERT(sqe);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = waker->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uint64_t)waker | s_waker_tag;
+    // 由所属线程进入等待时一起提交
+}
+
+bool IOManager::submitPoll(FdContext* fd_ctx, Event event) {
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    IoUring* ring = selectRing(fd_ctx->fd);
+    IoUring::MutexType::Lock lock(ring->getMutex());
+    io_uring_sqe* sqe = ring->getSqe();
+    if (!sqe) {
+        return false;
+    }
+    // 单次的 poll, 就绪后内核自动移除, 不需要像 epoll 那样再调用 epoll_ctl
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd_ctx->fd;
+    sqe->poll32_events = event == READ ? POLLIN : POLLOUT;
+    sqe->user_data = UringData(fd_ctx, event == READ ? s_uring_poll_read 
+                                : s_uring_poll_write, ++event_ctx.gen);
+    event_ctx.ring = ring;
+    submitRing(ring);
+    return true;
+}
+
+void IOManager::cancelUring(FdContext* fd_ctx, Event event, bool trigger) {
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    bool is_io = event_ctx.request != nullptr;
+    if (event_ctx.ring) {
+        IoUring::MutexType::Lock lock(event_ctx.ring->getMutex());
+        io_uring_sqe* sqe = event_ctx.ring->getSqe();
+        if (sqe) {
+            uint64_t kind = is_io ? (event == READ ? s_uring_io_read : s_uring_io_write)
+                                : (event == READ ? s_uring_poll_read : s_uring_poll_write);
+            sqe->opcode = is_io ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+            sqe->addr = UringData(fd_ctx, kind, event_ctx.gen);
+            sqe->user_data = 0;
+            // 取消立即提交, close 之后内核尽快释放 fd
+            event_ctx.ring->submit();
+        } else {
+            std::cout << "io_uring cancel fd=" << fd_ctx->fd << " event=" << event
+                << " no sqe" << std::endl;
         }
     }
+    if (is_io) {
+        // 内核可能还在使用协程栈上的缓冲区, 等完成事件到达后再恢复协程
+        event_ctx.request->cancelled = true;
+        return ;
+    }
+    // poll 请求的完成事件到达时事件已经清除, 会被忽略
+    --m_pendingEventCount;
+    if (trigger) {
+        fd_ctx->triggerEvent(event);
+    } else {
+        fd_ctx->events = (Event)(fd_ctx->events & ~event);
+        fd_ctx->resetContext(event_ctx);
+    }
 }
 
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-    // 新建上下文
-    FdContext* fd_ctx = nullptr;
-    // 上读锁, 判断是否需要扩充
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if (SYLAR_UNLICKLY(!fd_ctx)) {
+        std::cout << "addEvent fd=" << fd << " out of range" << std::endl;
+        return -1;
+    }
+    // 持久注册模式下用 fd 的上下文代数识别 fd 号被复用, 在 fd_ctx 的锁外查询
+    uint64_t generation = 0;
+    if (m_persistent) {
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+        generation = ctx ? ctx->getGeneration() : 0;
     }
 
     // 当前的事件中应当不含将添加的事件
@@ -120,21 +393,71 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         SYLAR_ASSERT(!(fd_ctx->events & event));
     }
 
-    // 修改 or 添加
-    // 对 epoll 结构体进行设置
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    // 边缘触发, 原事件 + 新事件
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    if (m_backend == IO_URING) {
+        if (!submitPoll(fd_ctx, event)) {
+            std::cout << "addEvent io_uring is full, fd=" << fd
+                << " event=" << event << std::endl;
+            return -1;
+        }
+    } else if (m_persistent) {
+        // fd 没有经过本调度器的 hook close 就关闭了, 内核已经把它移出 epoll,
+        // 同一个 fd 号上新建的 fd 要重新注册, 旧的就绪状态也不属于它
+        if (fd_ctx->registered && fd_ctx->generation != generation) {
+            fd_ctx->registered = false;
+            fd_ctx->ready = NONE;
+        }
+        // 等待之前已经就绪, 消耗掉就绪状态
+        // 协程不能在挂起之前被调度到其他线程, 交给调用方直接重试
+        if (fd_ctx->ready & event) {
+            fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+            if (!cb) {
+                return 1;
+            }
+            schedule(&cb);
+            return 0;
+        }
+        if (!fd_ctx->registered) {
+            fd_ctx->epfd = selectEpoll(fd);
+            epoll_event epevent;
+            epevent.events = EPOLLET | EPOLLIN | EPOLLOUT;
+            epevent.data.ptr = fd_ctx;
+            int op = EPOLL_CTL_ADD;
+            int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+            // fd 没有关闭, 只是注册之后才在 FdManager 中创建上下文, 还在 epoll 中, 改为修改注册
+            if(rt && errno == EEXIST) {
+                op = EPOLL_CTL_MOD;
+                rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+            }
+            if(rt) {
+                std::cout << "epoll_ctl(" << fd_ctx->epfd << ", "
+                    << op << "," << fd << "," << epevent.events << "):"
+                    << rt << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
+                return -1;
+            }
+            fd_ctx->registered = true;
+            fd_ctx->generation = generation;
+        }
+    } else {
+        // 修改 or 添加
+        // 没有事件的 fd 可以重新选择 epoll
+        if (!fd_ctx->events) {
+            fd_ctx->epfd = selectEpoll(fd);
+        }
+        // 对 epoll 结构体进行设置
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        // 边缘触发, 原事件 + 新事件
+        epevent.events = EPOLLET | fd_ctx->events | event;
+        epevent.data.ptr = fd_ctx;
 
-    // 通过调用 epoll_ctl 更新
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) {
-        std::cout << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
-        return -1;
+        // 通过调用 epoll_ctl 更新
+        int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+        if(rt) {
+            std::cout << "epoll_ctl(" << fd_ctx->epfd << ", "
+                << op << "," << fd << "," << epevent.events << "):"
+                << rt << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
+            return -1;
+        }
     }
 
     // 增加事件
@@ -148,6 +471,11 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
                     && !event_ctx.cb);
     // 更新上下文内容
     event_ctx.scheduler = Scheduler::GetThis();
+    // 分片模式下由工作线程注册的事件回到该线程执行, 连接的处理不会跨线程
+    if (m_sharded && event_ctx.scheduler == this
+            && GetWorkerIndex() >= 0 && GetWorkerIndex() < (int)m_shardCount) {
+        event_ctx.thread = sylar::GetThreadId();
+    }
     if (cb) {
         event_ctx.cb.swap(cb);
     } else {
@@ -157,19 +485,131 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     return 0;
 }
 
+bool IOManager::submitIo(int fd, IoRequest& req, uint64_t timeout_ms) {
+    // 需要挂起当前协程, 等待完成事件恢复
+    // 请求和用户的缓冲区一般在协程栈上, 内核在协程切出后写入
+    // 共享栈协程切出后栈被下一个协程占用, 只能走等待就绪的路径
+    if (m_backend != IO_URING || Scheduler::GetThis() != this
+            || Fiber::GetThis()->isSharedStack()) {
+        return false;
+    }
+    Event event = (req.op == IO_WRITE || req.op == IO_SEND || req.op == IO_CONNECT) 
+                    ? WRITE : READ;
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if (!fd_ctx) {
+        return false;
+    }
+    {
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        // 已经有协程在等待同一事件, 由调用方按原来的方式处理
+        if (fd_ctx->events & event) {
+            return false;
+        }
+        FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+        IoUring* ring = selectRing(fd);
+        IoUring::MutexType::Lock lock2(ring->getMutex());
+        // 请求和它的超时链接在一起, 需要在同一次提交中
+        bool has_timeout = timeout_ms != ~0ull;
+        if (!ring->reserve(has_timeout ? 2 : 1)) {
+            return false;
+        }
+        io_uring_sqe* sqe = ring->getSqe();
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)req.buf;
+        switch (req.op) {
+            case IO_READ:
+                sqe->opcode = IORING_OP_READ;
+                sqe->len = std::min<size_t>(req.len, UINT32_MAX);
+                // 从文件当前位置读写
+                sqe->off = (uint64_t)-1;
+                break;
+            case IO_WRITE:
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->len = std::min<size_t>(req.len, UINT32_MAX);
+                sqe->off = (uint64_t)-1;
+                break;
+            case IO_RECV:
+                sqe->opcode = IORING_OP_RECV;
+                sqe->len = std::min<size_t>(req.len, UINT32_MAX);
+                sqe->msg_flags = req.flags;
+                break;
+            case IO_SEND:
+                sqe->opcode = IORING_OP_SEND;
+                sqe->len = std::min<size_t>(req.len, UINT32_MAX);
+                sqe->msg_flags = req.flags;
+                break;
+            case IO_ACCEPT:
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->addr2 = (uint64_t)req.addrlen;
+                sqe->accept_flags = req.flags;
+                break;
+            case IO_CONNECT:
+                sqe->opcode = IORING_OP_CONNECT;
+                // 地址长度放在 off 中
+                sqe->off = req.len;
+                break;
+            default:
+                SYLAR_ASSERT2(false, "submitIo op");
+        }
+        sqe->user_data = UringData(fd_ctx, event == READ ? s_uring_io_read 
+                                    : s_uring_io_write, ++event_ctx.gen);
+        if (has_timeout) {
+            // 超时后内核取消请求, 请求以 -ECANCELED 完成
+            sqe->flags |= IOSQE_IO_LINK;
+            req.timeout.tv_sec = timeout_ms / 1000;
+            req.timeout.tv_nsec = timeout_ms % 1000 * 1000000;
+            io_uring_sqe* tsqe = ring->getSqe();
+            tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+            tsqe->fd = -1;
+            tsqe->addr = (uint64_t)&req.timeout;
+            tsqe->len = 1;
+            tsqe->user_data = 0;
+        }
+
+        ++m_pendingEventCount;
+        fd_ctx->events = (Event)(fd_ctx->events | event);
+        event_ctx.scheduler = this;
+        event_ctx.fiber = Fiber::GetThis();
+        event_ctx.ring = ring;
+        event_ctx.request = &req;
+        if (m_sharded && GetWorkerIndex() < (int)m_shardCount) {
+            event_ctx.thread = sylar::GetThreadId();
+        }
+        submitRing(ring);
+    }
+    sylar::Fiber::YieldToHold();
+    // 没有被 cancelEvent 取消却以 -ECANCELED 完成, 说明是链接的超时到了
+    if (req.res == -ECANCELED && !req.cancelled) {
+        req.res = -ETIMEDOUT;
+    }
+    return true;
+}
+
 bool IOManager::delEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!fd_ctx->events & event) {
+    if (!(fd_ctx->events & event)) {
         return false;
     }
 
+    // 完成式操作不能丢下等待的协程, 和 cancelEvent 一样取消
+    if (m_backend == IO_URING) {
+        cancelUring(fd_ctx, event, false);
+        return true;
+    }
+
+    // 持久注册模式下只清除等待者, 保留注册
+    if (m_persistent) {
+        --m_pendingEventCount;
+        fd_ctx->events = (Event)(fd_ctx->events & ~event);
+        fd_ctx->resetContext(fd_ctx->getContext(event));
+        return true;
+    }
+
     // 和 addEvent 的操作类似
     Event new_events = (Event)(fd_ctx->events & ~event);
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
@@ -177,9 +617,9 @@ bool IOManager::delEvent(int fd, Event event) {
     epevent.events = EPOLLET | new_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
     if (rt) {
-        std::cout << "epoll_ctl(" << m_epfd << ", "
+        std::cout << "epoll_ctl(" << fd_ctx->epfd << ", "
             << op << "," << fd << "," << epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
         return false;
@@ -193,29 +633,43 @@ bool IOManager::delEvent(int fd, Event event) {
 }
 
 // 和 delEvecnt 不同的地方在于, cancel 会在返回前触发事件, 用于执行回调函数或者 fiber
+// io_uring 后端的完成式操作在内核确认取消后触发
 bool IOManager::cancelEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!fd_ctx->events & event) {
+    return cancelEvent(fd_ctx, event);
+}
+
+bool IOManager::cancelEvent(FdContext* fd_ctx, Event event) {
+    if (!(fd_ctx->events & event)) {
         return false;
     }
 
+    if (m_backend == IO_URING) {
+        cancelUring(fd_ctx, event, true);
+        return true;
+    }
+
+    if (m_persistent) {
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+        return true;
+    }
+
     Event new_events = (Event)(fd_ctx->events & ~event);
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = EPOLLET | new_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd_ctx->fd, &epevent);
     if (rt) {
-        std::cout << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
+        std::cout << "epoll_ctl(" << fd_ctx->epfd << ", "
+            << op << "," << fd_ctx->fd << "," << epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
         return false;
     }
@@ -228,26 +682,37 @@ bool IOManager::cancelEvent(int fd, Event event) {
 
 // 取消指定 fd 的所有事件, 同样也会触发回调
 bool IOManager::cancelAll(int fd) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!fd_ctx->events) {
+    // 持久注册模式下没有等待者也要移除注册, fd 关闭后编号会被复用
+    if (!fd_ctx->events && !fd_ctx->registered) {
         return false;
     }
 
+    if (m_backend == IO_URING) {
+        if (fd_ctx->events & READ) {
+            cancelUring(fd_ctx, READ, true);
+        }
+        if (fd_ctx->events & WRITE) {
+            cancelUring(fd_ctx, WRITE, true);
+        }
+        return true;
+    }
+
     int op = EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = 0;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
+    fd_ctx->registered = false;
+    fd_ctx->ready = NONE;
     if (rt) {
-        std::cout << "epoll_ctl(" << m_epfd << ", "
+        std::cout << "epoll_ctl(" << fd_ctx->epfd << ", "
             << op << "," << fd << "," << epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
         return false;
@@ -266,18 +731,100 @@ bool IOManager::cancelAll(int fd) {
     return true;
 }
 
+int IOManager::addTimedEvent(int fd, Event event, uint64_t timeout_ms, uint64_t slack_ms) {
+    int rt = addEvent(fd, event);
+    if (rt || timeout_ms == ~0ull) {
+        return rt;
+    }
+    FdContext* fd_ctx = getFdContext(fd, false);
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    event_ctx.timedout = false;
+    // 注册之后协程挂起之前, 事件可能已经触发
+    if (!(fd_ctx->events & event)) {
+        event_ctx.deadline = 0;
+        return 0;
+    }
+    event_ctx.deadline = sylar::GetCoarseMS() + timeout_ms;
+    // 回调只捕获两个指针, 存在 std::function 内部, 不分配内存
+    // 读写的定时器共用一个回调, 触发时检查两个方向谁到期了
+    rearmTimer(event_ctx.timer, timeout_ms, [this, fd_ctx]() {
+        onIoTimeout(fd_ctx);
+    }, slack_ms);
+    return 0;
+}
+
+bool IOManager::finishTimedEvent(int fd, Event event) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    bool timedout = event_ctx.timedout;
+    if (event_ctx.deadline && event_ctx.timer) {
+        event_ctx.timer->cancel();
+    }
+    event_ctx.deadline = 0;
+    event_ctx.timedout = false;
+    return timedout;
+}
+
+void IOManager::onIoTimeout(FdContext* fd_ctx) {
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    uint64_t now_ms = sylar::GetCoarseMS();
+    // 之前等待的定时器可能在新的等待开始后才执行, 按本次等待的超时时间判断
+    for (Event event : {READ, WRITE}) {
+        FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+        if ((fd_ctx->events & event) && event_ctx.deadline
+                && event_ctx.deadline <= now_ms) {
+            event_ctx.deadline = 0;
+            event_ctx.timedout = true;
+            cancelEvent(fd_ctx, event);
+        }
+    }
+}
+
 IOManager* IOManager::GetThis() {
     // 下转型
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
 }
 
-// 通过管道唤醒任务
-void IOManager::tickle() {
+// 通过 eventfd 唤醒一个空闲线程
+void IOManager::tickle(int thread) {
     if (!hasIdleThreads()) {
         return ;
     }
-    int rt = write(m_tickleFds[1], "T", 1);
-    SYLAR_ASSERT(rt == 1);
+    // 指定了线程的任务只写该线程的 eventfd, 该线程不空闲时自然会取到任务
+    // 非分片模式下所有 eventfd 在同一个 epoll 中, 内核把事件交给任意一个等待者,
+    // 收到别人唤醒的线程会通过 tickleThreadTasks 再转交
+    if (thread != -1) {
+        for (auto waker : m_wakers) {
+            if (waker->thread == thread) {
+                wakeup(waker);
+                return ;
+            }
+        }
+    }
+    for (auto waker : m_wakers) {
+        if (wakeup(waker)) {
+            return ;
+        }
+    }
+}
+
+bool IOManager::wakeup(Waker* waker) {
+    if (!waker->idle) {
+        return false;
+    }
+    bool expected = false;
+    if (!waker->notified.compare_exchange_strong(expected, true)) {
+        return false;
+    }
+    uint64_t one = 1;
+    int rt = write(waker->fd, &one, sizeof(one));
+    SYLAR_ASSERT(rt == sizeof(one));
+    return true;
 }
 
 bool IOManager::stopping() {
@@ -287,28 +834,53 @@ bool IOManager::stopping() {
 
 bool IOManager::stopping(uint64_t& timeout) {
     timeout = getNextTimer();
-    return timeout == ~0ull 
+    // 其他线程的分片中也没有定时器
+    return !hasTimer()
         && m_pendingEventCount == 0 
         && Scheduler::stopping();
 }
 
+IOManager::PollStats IOManager::getPollStats() const {
+    PollStats stats;
+    stats.loops = m_pollLoops;
+    stats.wakeups = m_pollWakeups;
+    stats.events = m_polledEvents;
+    stats.blocked_us = m_blockedUs;
+    stats.busy_poll_hits = m_busyPollHits;
+    return stats;
+}
+
 // 重写了 Scheduler::idle
 void IOManager::idle() {
-    const uint64_t MAX_EVENTS = 256;
-    // 用于接收 epoll_wait 触发的 fd
-    epoll_event* events = new epoll_event[MAX_EVENTS]();
-    std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr) {
-        delete[] ptr;
-    });
+    // 用于接收 epoll_wait 触发的 fd, 空闲协程存在期间一直复用
+    std::vector<epoll_event> events(m_epollBatch);
+    // 本线程当前的忙轮询时间, 轮询落空时减半, 等到事件时恢复为配置值
+    uint64_t busy_window = m_busyPollUs;
+
+    // 当前线程的 waker, 不属于工作线程时为 nullptr
+    int index = GetWorkerIndex();
+    Waker* self = index >= 0 && index < (int)m_wakers.size() ? m_wakers[index] : nullptr;
+    if (self) {
+        self->thread = sylar::GetThreadId();
+        // 本线程上添加的定时器放在自己的分片中
+        bindTimerShard(index);
+    }
 
     while(true) {
+        // 弹性新增的线程空闲超时, 结束空闲协程后线程退出
+        if (shouldRetire()) {
+            if (self) {
+                self->thread = -1;
+            }
+            break;
+        }
         // 是否结束
         uint64_t next_timeout = 0;
         if (stopping(next_timeout)) {
-            if (next_timeout == ~0ull) {
-                std::cout << "name=" << getName() << "iomanager idle stopped" << std::endl;
-                break;
-            }
+            std::cout << "name=" << getName() << "iomanager idle stopped" << std::endl;
+            // 依次唤醒其他阻塞中的线程, 让它们也检查到停止状态
+            tickle();
+            break;
         }
 
         int rt = 0;
@@ -322,8 +894,62 @@ void IOManager::idle() {
             } else {
                 next_timeout = MAX_TIMEOUT;
             }
+            // 弹性线程到空闲超时的时候醒来退出
+            uint64_t retire_timeout = getRetireTimeout();
+            if (retire_timeout < next_timeout) {
+                next_timeout = retire_timeout;
+            }
+            // 先标记为空闲再复查任务, 与 schedule 中先入队再 tickle 的顺序配合
+            // 保证两边至少有一方看到对方, 任务不会等到超时才被执行
+            if (self) {
+                self->idle = true;
+            }
+            if (hasPendingTask()) {
+                next_timeout = 0;
+            }
+            // 定时器同理, 标记空闲之前插到首部的定时器发出的唤醒找不到空闲线程
+            uint64_t timer_timeout = getNextTimer();
+            if (timer_timeout < next_timeout) {
+                next_timeout = timer_timeout;
+            }
+            if (m_backend == IO_URING) {
+                // 提交攒下的请求并等待完成事件, 完成事件在下面统一处理
+                uint64_t begin = GetMonotonicUS();
+                self->ring->submitAndWait(next_timeout);
+                m_blockedUs += GetMonotonicUS() - begin;
+                t_uring_tasks = 0;
+                self->idle = false;
+                break;
+            }
+            int epfd = self ? self->epfd : m_epfd;
+            rt = 0;
+            // 阻塞之前先用不等待的 epoll_wait 轮询一段时间, 省掉睡眠和唤醒的延迟
+            // 不超过下一个定时器的时间, 有任务时立即停止
+            if (busy_window && next_timeout) {
+                uint64_t spin_us = std::min<uint64_t>(busy_window, next_timeout * 1000);
+                uint64_t begin = GetMonotonicUS();
+                bool hit = false;
+                do {
+                    rt = epoll_wait(epfd, &events[0], m_epollBatch, 0);
+                    hit = rt > 0 || hasPendingTask();
+                } while (!hit && rt == 0 && GetMonotonicUS() - begin < spin_us);
+                if (hit) {
+                    ++m_busyPollHits;
+                    busy_window = m_busyPollUs;
+                } else {
+                    // 负载低时少浪费 CPU, 但保留最小的窗口, 负载回来后还能恢复
+                    busy_window = std::max<uint64_t>(busy_window / 2, m_busyPollUs / 8);
+                }
+            }
             // 调用 epoll_wait 等待时间触发
-            rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int)next_timeout);
+            if (rt == 0 && !hasPendingTask()) {
+                uint64_t begin = GetMonotonicUS();
+                rt = epoll_wait(epfd, &events[0], m_epollBatch, (int)next_timeout);
+                m_blockedUs += GetMonotonicUS() - begin;
+            }
+            if (self) {
+                self->idle = false;
+            }
 
             if (rt < 0 && errno == EINTR) {
 
@@ -331,6 +957,8 @@ void IOManager::idle() {
                 break;
             }
         } while (true);
+        // 每次醒来刷新一次缓存的时钟, 定时器检查和之后的任务都读它
+        UpdateCoarseClock();
 
         // 这里用了 TimerManager
         // 检查是否有超时的定时器
@@ -343,21 +971,36 @@ void IOManager::idle() {
             cbs.clear();
         }
 
+        // io_uring 后端没有 epoll 事件, rt 为 0
+        size_t polled = rt > 0 ? rt : 0;
+        if (m_backend == IO_URING) {
+            polled = processCompletions(self);
+        }
+        ++m_pollLoops;
+        if (polled) {
+            ++m_pollWakeups;
+            m_polledEvents += polled;
+        }
+
         // 遍历处理触发的 fd
         for (int i = 0; i < rt; ++i) {
             epoll_event& event = events[i];
-            // 如果是管道(用于唤醒任务), 单独处理
-            if (event.data.fd == m_tickleFds[0]) {
-                uint8_t dummy[256];
-                while (read(m_tickleFds[0], &dummy, sizeof(dummy)) == 1) ;
+            // 如果是 eventfd(用于唤醒线程), 单独处理
+            if (event.data.u64 & s_waker_tag) {
+                Waker* waker = (Waker*)(event.data.u64 & ~s_waker_tag);
+                uint64_t dummy;
+                while (read(waker->fd, &dummy, sizeof(dummy)) > 0) ;
+                waker->notified = false;
+                onWakeup();
                 continue;
             }
 
             FdContext* fd_ctx = (FdContext*)event.data.ptr;
             FdContext::MutexType::Lock lock(fd_ctx->mutex);
             // 如果是错误或者挂断, 强制触发已注册的时间
+            // 持久注册模式下读写都记为就绪, 之后的等待者直接重试, 由 IO 返回错误
             if (event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                event.events |= (EPOLLIN | EPOLLOUT) & (m_persistent ? ~0u : fd_ctx->events);
             }
             // 新建变量 real_event 记录需要触发的事件
             int real_events = NONE;
@@ -368,6 +1011,21 @@ void IOManager::idle() {
                 real_events |= WRITE;
             }
 
+            // 持久注册模式下没有等待者的事件记为就绪, 不修改注册
+            if (m_persistent) {
+                fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~fd_ctx->events));
+                real_events &= fd_ctx->events;
+                if (real_events & READ) {
+                    fd_ctx->triggerEvent(READ, true);
+                    --m_pendingEventCount;
+                }
+                if (real_events & WRITE) {
+                    fd_ctx->triggerEvent(WRITE, true);
+                    --m_pendingEventCount;
+                }
+                continue;
+            }
+
             if ((fd_ctx->events & real_events) == NONE) {
                 continue;
             }
@@ -379,9 +1037,9 @@ void IOManager::idle() {
             event.events = EPOLLET | left_events;
 
             // epoll_ctl 
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+            int rt2 = epoll_ctl(fd_ctx->epfd, op, fd_ctx->fd, &event);
             if (rt2) {
-                std::cout << "epoll_ctl(" << m_epfd << ", "
+                std::cout << "epoll_ctl(" << fd_ctx->epfd << ", "
                     << op << "," << fd_ctx->fd << "," << event.events << "):"
                     << rt2 << " (" << errno << ") (" << strerror(errno) << ")" << std::endl;
                 continue;
@@ -389,11 +1047,11 @@ void IOManager::idle() {
 
             // 触发事件
             if (real_events & READ) {
-                fd_ctx->triggerEvent(READ);
+                fd_ctx->triggerEvent(READ, true);
                 --m_pendingEventCount;
             }
             if (real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
+                fd_ctx->triggerEvent(WRITE, true);
                 --m_pendingEventCount;
             }
         }
@@ -405,6 +1063,59 @@ void IOManager::idle() {
 
         raw_ptr->swapOut();
     }
+    // 线程退出, 分片中剩下的定时器交给其他线程
+    unbindTimerShard();
+}
+
+size_t IOManager::processCompletions(Waker* self) {
+    static const size_t MAX_CQES = 64;
+    io_uring_cqe cqes[MAX_CQES];
+    size_t total = 0;
+    while (true) {
+        size_t n = self->ring->reap(cqes, MAX_CQES);
+        total += n;
+        for (size_t i = 0; i < n; ++i) {
+            io_uring_cqe& cqe = cqes[i];
+            uint64_t kind = cqe.user_data & s_uring_kind_mask;
+            // 取消请求和超时的完成事件
+            if (!kind) {
+                continue;
+            }
+            if (kind == s_waker_tag) {
+                Waker* waker = (Waker*)(cqe.user_data & s_uring_ptr_mask);
+                uint64_t dummy;
+                while (read(waker->fd, &dummy, sizeof(dummy)) > 0) ;
+                waker->notified = false;
+                onWakeup();
+                // poll 是单次的, 重新挂上
+                armWaker(waker);
+                continue;
+            }
+
+            FdContext* fd_ctx = (FdContext*)(cqe.user_data & s_uring_ptr_mask);
+            uint16_t gen = cqe.user_data >> s_uring_gen_shift;
+            bool is_io = kind == s_uring_io_read || kind == s_uring_io_write;
+            Event event = (kind == s_uring_poll_read || kind == s_uring_io_read) ? READ : WRITE;
+            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+            // 已经被删除或者重新注册过的旧请求
+            if (!(fd_ctx->events & event) || event_ctx.gen != gen
+                    || is_io != (event_ctx.request != nullptr)) {
+                continue;
+            }
+            if (is_io) {
+                event_ctx.request->res = cqe.res;
+            } else if (cqe.res == -ECANCELED) {
+                continue;
+            }
+            fd_ctx->triggerEvent(event, true);
+            --m_pendingEventCount;
+        }
+        if (n < MAX_CQES) {
+            break;
+        }
+    }
+    return total;
 }
 
 // 昂, 就是 tickle 了一下
@@ -412,4 +1123,11 @@ void IOManager::onTimerInsertedAtFront() {
     tickle();
 }
 
+// 只唤醒分片所属的线程
+void IOManager::onTimerShardChanged(int shard) {
+    if (shard >= 0 && shard < (int)m_wakers.size()) {
+        wakeup(m_wakers[shard]);
+    }
+}
+
 }
\ No newline at end of file
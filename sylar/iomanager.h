@@ -1,8 +1,10 @@
 #ifndef __SYLAR_IOMANAGER_H__
 #define __SYLAR_IOMANAGER_H__
 
+#include <sys/socket.h>
 #include "scheduler.h"
 #include "timer.h"
+#include "uring.h"
 
 namespace sylar {
 
@@ -16,6 +18,42 @@ public:
         READ    = 0x1,
         WRITE   = 0x4,
     };
+    // 等待 IO 事件的方式
+    enum Backend {
+        // 就绪通知, 事件就绪后由协程再次调用系统调用
+        EPOLL,
+        // 完成通知, 请求批量提交, 读写完成后协程直接拿到结果
+        IO_URING,
+    };
+    // io_uring 后端支持的完成式操作
+    enum IoOp {
+        IO_NONE = 0,
+        IO_READ,
+        IO_RECV,
+        IO_WRITE,
+        IO_SEND,
+        IO_ACCEPT,
+        IO_CONNECT,
+    };
+    // 一次完成式操作的参数和结果, 放在发起操作的协程栈上
+    struct IoRequest {
+        IoOp op = IO_NONE;
+        // 读写的缓冲区, accept 和 connect 为地址
+        void* buf = nullptr;
+        // 读写的长度, connect 为地址长度
+        size_t len = 0;
+        // recv/send 的 flags, accept 的 flags
+        int flags = 0;
+        // accept 返回的地址长度
+        socklen_t* addrlen = nullptr;
+        // 结果, 和系统调用的返回值相同, 失败时为 -errno
+        // 超时为 -ETIMEDOUT, 被 cancelEvent 取消为 -ECANCELED
+        int res = 0;
+        // 是否被 cancelEvent 取消
+        bool cancelled = false;
+        // 链接在请求之后的超时
+        __kernel_timespec timeout;
+    };
 
 private:
     struct FdContext {
@@ -27,47 +65,198 @@ private:
             Fiber::ptr fiber;
             // 回调函数
             std::function<void()> cb;
+            // 分片模式下事件就绪后回到注册事件的线程执行, -1 表示任意线程
+            int thread = -1;
+            // io_uring 后端: 请求提交到的 io_uring
+            IoUring* ring = nullptr;
+            // io_uring 后端: 请求的序号, 用于忽略已取消或过期的完成事件
+            uint16_t gen = 0;
+            // io_uring 后端: 完成式操作的请求, 为空表示只等待就绪
+            IoRequest* request = nullptr;
+            // addTimedEvent 的超时定时器, 触发或取消后留给下次等待复用
+            Timer::ptr timer;
+            // 本次等待的超时时间点(GetCoarseMS), 0 为不超时
+            uint64_t deadline = 0;
+            // 本次等待是否因超时结束
+            bool timedout = false;
         };
         // 根据事件类型返回事件上下文
         EventContext& getContext(Event event);
         // 指定的事件上下文清空
         void resetContext(EventContext& ctx);
-        void triggerEvent(Event event);
+        // 触发事件, 调度等待的协程或回调
+        // local 为 true 表示在反应器线程中触发, 任务可以直接放入当前线程的就绪列表
+        void triggerEvent(Event event, bool local = false);
 
         int fd = 0;
+        // 注册在哪个 epoll 中, 没有事件时可以换到其他 epoll
+        // 持久注册模式下注册后不再更换, 直到 cancelAll
+        int epfd = -1;
         EventContext read;
         EventContext write;
         Event events = NONE;
+        // 持久注册模式: 已经就绪但还没有等待者的事件
+        Event ready = NONE;
+        // 持久注册模式: 是否已经注册到 epoll
+        bool registered = false;
+        // 持久注册模式: 注册时 fd 在 FdManager 中的上下文代数, 不由 hook 创建的 fd 为 0
+        uint64_t generation = 0;
         MutexType mutex;
     };
+    // 每个工作线程一个 eventfd, 用于定向唤醒阻塞在 epoll_wait 中的线程
+    struct Waker {
+        // eventfd
+        int fd = -1;
+        // 线程等待的 epoll, 分片模式下每个线程一个, 否则为 m_epfd
+        int epfd = -1;
+        // io_uring 后端时线程等待的 io_uring
+        IoUring* ring = nullptr;
+        // 所属线程 id, 线程第一次进入 idle 时记录
+        std::atomic<int> thread = {-1};
+        // 所属线程是否阻塞在 epoll_wait 中
+        std::atomic<bool> idle = {false};
+        // eventfd 是否已写入且尚未被读走, 避免重复唤醒
+        std::atomic<bool> notified = {false};
+    };
 
 public:
+    // idle 循环的统计
+    struct PollStats {
+        // idle 循环的次数
+        uint64_t loops = 0;
+        // 等到了事件的次数
+        uint64_t wakeups = 0;
+        // 等到的事件总数, 除以 wakeups 为每次唤醒的平均事件数
+        uint64_t events = 0;
+        // 阻塞在 epoll_wait 或 io_uring_enter 中的总时间, 微秒
+        uint64_t blocked_us = 0;
+        // 忙轮询期间等到事件或任务, 没有进入阻塞的次数
+        uint64_t busy_poll_hits = 0;
+    };
+
+    // sharded 为 true 时每个工作线程拥有自己的 epoll, fd 注册到第一次添加事件的线程的 epoll 中,
+    // 事件就绪后回到注册事件的线程执行, 一个连接的读写始终在同一个线程上
+    // 也可以通过配置 iomanager.sharded 按名称开启
+    // backend 为 IO_URING 时每个工作线程一个 io_uring, 内核不支持时退回 epoll
+    // 也可以通过配置 iomanager.backend 按名称选择
+    // epoll 后端可以通过配置 iomanager.persistent 按名称开启持久注册模式:
+    // fd 第一次添加事件时以 EPOLLIN | EPOLLOUT | EPOLLET 注册, 直到 cancelAll 才移除,
+    // 就绪状态记录在 FdContext 中, 等待和触发事件都不再调用 epoll_ctl
+    // fd 不经过本调度器的 hook close 关闭时, 同一个 fd 号由 hook 重新创建后按 FdCtx 的代数重新注册,
+    // 不由 hook 创建的 fd 调用方需要在关闭前 cancelAll
     IOManager(size_t threads = 1, bool use_caller = true, 
-        const std::string name = "");
+        const std::string name = "", bool work_stealing = false, bool sharded = false,
+        Backend backend = EPOLL);
     ~IOManager();
 
+    // 是否为分片模式
+    bool isSharded() const { return m_sharded; }
+    // 分片模式下拥有 fd 的 epoll 的个数, 第 i 个属于第 i 个工作线程
+    // 不含弹性线程, use_caller 时也不含根线程, 根线程只在 stop 中运行调度, 平时不会 accept 和处理连接
+    // 非分片模式为 1
+    size_t getShardCount() const { return m_sharded ? m_shardCount : 1; }
+
+    // 成功返回 0, 失败返回 -1
+    // 持久注册模式下事件已经就绪时: 有回调直接调度回调, 返回 0; 
+    // 没有回调时不注册, 返回 1, 调用方不必挂起, 直接重试 IO
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
     bool delEvent(int fd, Event event);
     bool cancelEvent(int fd, Event event);
     bool cancelAll(int fd);
+    // 带超时地为当前协程添加事件, timeout_ms 为 ~0ull 时不超时, 返回值同 addEvent
+    // 超时的定时器和状态保存在 fd 的上下文中, 重复等待时复用, 不分配内存(时间轮存储时)
+    // 返回 0 时调用方挂起, 恢复后必须调用 finishTimedEvent
+    int addTimedEvent(int fd, Event event, uint64_t timeout_ms, uint64_t slack_ms = 0);
+    // 结束 addTimedEvent 的等待, 取消还没触发的定时器, 返回是否因超时恢复
+    bool finishTimedEvent(int fd, Event event);
+    // io_uring 后端下提交一个完成式操作并挂起当前协程, 完成后结果在 req.res 中
+    // timeout_ms 不为 ~0ull 时超时的请求被内核取消
+    // 只能在本调度器的协程中调用, 不是 io_uring 后端或者提交失败返回 false, 协程没有挂起
+    // req 和缓冲区在完成前必须有效, 共享栈协程的栈切出后会被覆盖, 总是返回 false
+    // 等待期间对同一事件调用 cancelEvent 会取消请求, 协程在内核确认取消后恢复
+    bool submitIo(int fd, IoRequest& req, uint64_t timeout_ms);
+
+    Backend getBackend() const { return m_backend; }
+    bool isUring() const { return m_backend == IO_URING; }
+    // 是否为持久注册模式
+    bool isPersistent() const { return m_persistent; }
+    // 一次 epoll_wait 最多返回的事件数
+    uint32_t getEpollBatch() const { return m_epollBatch; }
+    // 阻塞之前忙轮询的最长时间, 微秒, 0 表示不忙轮询
+    uint32_t getBusyPollUs() const { return m_busyPollUs; }
+    PollStats getPollStats() const;
 
     static IOManager* GetThis();
 
 protected:
-    void tickle() override;
+    void tickle(int thread = -1) override;
     bool stopping() override;
     bool stopping(uint64_t& timeout);
     void idle() override;
     void onTimerInsertedAtFront() override;
+    void onTimerShardChanged(int shard) override;
+    void onTaskYield() override;
 
-    void contextResize(size_t size);
+    // 返回 fd 对应的上下文, 不加锁
+    // 所在的块还没分配时, auto_create 为 true 则分配, 否则返回 nullptr; fd 超出容量返回 nullptr
+    FdContext* getFdContext(int fd, bool auto_create);
+    // fd 还没有事件时选择注册到哪个 epoll
+    // 分片模式下当前线程拥有分片时选自己的 epoll, 否则按 fd 取模
+    int selectEpoll(int fd);
+    // 当前线程提交请求使用的 io_uring
+    IoUring* selectRing(int fd);
+    // 当前线程拥有分片时返回自己的序号, 非工作线程, 弹性线程和根线程按 fd 取模
+    size_t selectShard(int fd);
+    // 所属线程的请求留到任务切换或空闲时批量提交, 其他线程的 io_uring 立即提交
+    // 调用方持有 ring 的 mutex
+    void submitRing(IoUring* ring);
+    // io_uring 后端: 为事件提交 poll 请求
+    bool submitPoll(FdContext* fd_ctx, Event event);
+    // io_uring 后端: 取消事件对应的请求, 调用方持有 fd_ctx->mutex
+    // poll 请求立即移除, trigger 为 true 时触发事件; 完成式操作等内核确认取消后由完成事件触发
+    void cancelUring(FdContext* fd_ctx, Event event, bool trigger);
+    // io_uring 后端: 为 eventfd 提交 poll 请求, 被唤醒后重新提交
+    void armWaker(Waker* waker);
+    // io_uring 后端: 处理所有完成事件, 返回处理的个数
+    size_t processCompletions(Waker* self);
+    // 写 eventfd 唤醒 waker 对应的空闲线程, 成功写入返回 true
+    bool wakeup(Waker* waker);
+    // 取消事件并触发, 调用方持有 fd_ctx->mutex
+    bool cancelEvent(FdContext* fd_ctx, Event event);
+    // addTimedEvent 的定时器回调, 触发 fd 上已经超时的等待
+    void onIoTimeout(FdContext* fd_ctx);
 private:
-    int m_epfd = 0;
-    int m_tickleFds[2];
+    // 非分片模式下所有线程共用的 epoll
+    int m_epfd = -1;
+    // 是否为分片模式
+    bool m_sharded = false;
+    // 拥有 epoll / io_uring 中 fd 的工作线程数, 序号从 0 开始
+    size_t m_shardCount = 1;
+    // 等待 IO 事件的方式
+    Backend m_backend = EPOLL;
+    // fd 是否持久注册在 epoll 中
+    bool m_persistent = false;
+    // io_uring 后端下所属线程的请求累计多少个, 或者经过多少个任务之后提交
+    uint32_t m_uringBatch = 0;
+    uint32_t m_epollBatch = 256;
+    uint32_t m_busyPollUs = 0;
+    // idle 循环的统计
+    std::atomic<uint64_t> m_pollLoops = {0};
+    std::atomic<uint64_t> m_pollWakeups = {0};
+    std::atomic<uint64_t> m_polledEvents = {0};
+    std::atomic<uint64_t> m_blockedUs = {0};
+    std::atomic<uint64_t> m_busyPollHits = {0};
+    // 下标为工作线程序号
+    std::vector<Waker*> m_wakers;
 
     std::atomic<size_t> m_pendingEventCount = {0};
-    RWMutexType m_mutex;
-    std::vector<FdContext*> m_fdContexts;
+    // 两级的 FdContext 表, 第一级按 RLIMIT_NOFILE 一次分配好, 之后不再改变
+    // 第二级每块 FD_CHUNK_SIZE 个, 第一次用到时用 CAS 装入, 装入后直到析构都不移动
+    // 查找不需要加锁, 返回的 FdContext* 在 IOManager 的生命周期内一直有效
+    static const int FD_CHUNK_SHIFT = 10;
+    static const int FD_CHUNK_SIZE = 1 << FD_CHUNK_SHIFT;
+    std::atomic<FdContext*>* m_fdChunks = nullptr;
+    size_t m_fdChunkCount = 0;
 };
 
 }
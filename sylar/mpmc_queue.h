@@ -0,0 +1,107 @@
+#ifndef __SYLAR_MPMC_QUEUE_H__
+#define __SYLAR_MPMC_QUEUE_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include "noncopyable.h"
+
+namespace sylar {
+
+// 有界的无锁多生产者多消费者队列
+// 每个槽位带一个序号, 生产者和消费者各自用 CAS 抢占位置, 通过序号判断槽位是否可写或可读
+// 容量向上取整为 2 的幂, 队列满时 tryPush 失败, 由调用方决定退路
+template<class T>
+class MPMCQueue : Noncopyable {
+public:
+    explicit MPMCQueue(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) {
+            cap <<= 1;
+        }
+        m_mask = cap - 1;
+        m_cells = new Cell[cap];
+        for (size_t i = 0; i < cap; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~MPMCQueue() {
+        delete[] m_cells;
+    }
+
+    // 入队成功时从 v 移走数据, 失败时 v 保持不变
+    bool tryPush(T& v) {
+        Cell* cell;
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1
+                            , std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // 槽位还没被消费, 队列已满
+                return false;
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(v);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& v) {
+        Cell* cell;
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1
+                            , std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // 槽位还没写入, 队列为空
+                return false;
+            } else {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        v = std::move(cell->data);
+        // 释放槽位中残留的资源
+        cell->data = T();
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // 近似的元素个数, 只用于统计
+    size_t sizeApprox() const {
+        size_t tail = m_enqueuePos.load(std::memory_order_relaxed);
+        size_t head = m_dequeuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    Cell* m_cells;
+    size_t m_mask;
+    // 生产者和消费者的位置放在不同的缓存行, 避免互相干扰
+    alignas(64) std::atomic<size_t> m_enqueuePos = {0};
+    alignas(64) std::atomic<size_t> m_dequeuePos = {0};
+};
+
+}
+
+#endif
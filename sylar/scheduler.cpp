@@ -2,18 +2,75 @@
 #include "macro.h"
 #include "log.h"
 #include "hook.h"
+#include "config.h"
 
 #include <iostream>
+#include <algorithm>
+#include <unistd.h>
 
 namespace sylar {
 
+// 按调度器名称配置协程栈大小, 未配置的使用 fiber.stack_size
+static ConfigVar<std::map<std::string, uint32_t> >::ptr g_scheduler_stack_size =
+    Config::Lookup("scheduler.stack_size", std::map<std::string, uint32_t>()
+            , "fiber stack size of each scheduler, by scheduler name");
+// 每个调度线程缓存的已结束协程数量上限, 缓存的协程带着栈, 复用时只需重新绑定函数
+static ConfigVar<uint32_t>::ptr g_scheduler_fiber_pool_size =
+    Config::Lookup("scheduler.fiber_pool_size", (uint32_t)64
+            , "max terminated fibers cached by each scheduler thread");
+// 跨线程调度使用的无锁注入队列的容量, 向上取整为 2 的幂
+static ConfigVar<uint32_t>::ptr g_scheduler_inject_queue_size =
+    Config::Lookup("scheduler.inject_queue_size", (uint32_t)4096
+            , "capacity of the lock-free inject queue of each scheduler");
+// 公共队列中低优先级任务最多被跳过多少次调度, 0 表示严格按优先级
+static ConfigVar<uint32_t>::ptr g_scheduler_priority_fair_interval =
+    Config::Lookup("scheduler.priority_fair_interval", (uint32_t)8
+            , "every n-th dispatch takes lower priority tasks first");
+// 按调度器名称配置弹性模式下的最大线程数, 大于构造时的线程数才开启
+static ConfigVar<std::map<std::string, uint32_t> >::ptr g_scheduler_max_threads =
+    Config::Lookup("scheduler.max_threads", std::map<std::string, uint32_t>()
+            , "max threads of each elastic scheduler, by scheduler name");
+// 按调度器名称配置工作线程绑定的 CPU 列表
+static ConfigVar<std::map<std::string, std::vector<int> > >::ptr g_scheduler_cpu_affinity =
+    Config::Lookup("scheduler.cpu_affinity", std::map<std::string, std::vector<int> >()
+            , "cpus of the worker threads of each scheduler, by scheduler name");
+static ConfigVar<uint32_t>::ptr g_scheduler_busy_threshold =
+    Config::Lookup("scheduler.busy_threshold_ms", (uint32_t)100
+            , "add a thread after all threads are busy for this long");
+static ConfigVar<uint32_t>::ptr g_scheduler_idle_timeout =
+    Config::Lookup("scheduler.idle_timeout_ms", (uint32_t)30000
+            , "an elastic thread exits after idle for this long");
+// 工作窃取模式下一次从注入队列搬到本地队列的任务数
+static const size_t s_inject_batch = 32;
+
 static thread_local Scheduler* t_schedular = nullptr;
 static thread_local Fiber* t_scheduler_fiber = nullptr;
+// 当前线程在调度器中的工作线程序号, 用于定位本地队列
+static thread_local int t_worker_index = -1;
+// 当前线程是否刚被 tickle 唤醒
+static thread_local bool t_woken = false;
+// 当前线程取任务的次数, 用于定期先取低优先级任务
+static thread_local uint32_t t_dispatch_count = 0;
+// 当前线程最后一次执行任务的时间, 弹性线程据此判断空闲超时
+static thread_local uint64_t t_last_busy = 0;
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string name) 
-        :m_name(name) {
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string name
+                    , bool work_stealing) 
+        :m_name(name)
+        ,m_workStealing(work_stealing) {
     SYLAR_ASSERT(threads > 0);
 
+    m_fiberPoolSize = g_scheduler_fiber_pool_size->getValue();
+    m_fairInterval = g_scheduler_priority_fair_interval->getValue();
+    for (int i = 0; i < PRIORITY_COUNT; ++i) {
+        m_levels[i] = new LevelQueue(g_scheduler_inject_queue_size->getValue());
+    }
+    auto stack_sizes = g_scheduler_stack_size->getValue();
+    auto it = stack_sizes.find(m_name);
+    if (it != stack_sizes.end()) {
+        m_stackSize = it->second;
+    }
+
     if (use_caller) {
         // 若主线程也加入调度
         // 先创建一个主协程保存进程的上下文
@@ -35,11 +92,33 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string name)
         m_rootThread = sylar::GetThreadId();
         // 加入线程id池
         m_threadIds.push_back(m_rootThread);
+        // 根线程排在所有工作线程之后
+        t_worker_index = threads;
     } else {
         m_rootThread = -1;
     }
     // record threads count
     m_threadCount = threads;
+
+    auto cpus = g_scheduler_cpu_affinity->getValue();
+    auto cit = cpus.find(m_name);
+    if (cit != cpus.end()) {
+        m_cpus = cit->second;
+    }
+
+    auto max_threads = g_scheduler_max_threads->getValue();
+    auto mit = max_threads.find(m_name);
+    if (mit != max_threads.end()) {
+        setElastic(mit->second, g_scheduler_busy_threshold->getValue()
+                    , g_scheduler_idle_timeout->getValue());
+    }
+
+    if (m_workStealing) {
+        size_t workers = m_threadCount + (use_caller ? 1 : 0);
+        for (size_t i = 0; i < workers; ++i) {
+            m_workerQueues.push_back(new WorkerQueue);
+        }
+    }
 }
 
 Scheduler::~Scheduler() {
@@ -47,6 +126,19 @@ Scheduler::~Scheduler() {
     loginfo2("delete a scheduler here");
     if (GetThis() == this) {
         t_schedular = nullptr;
+        t_worker_index = -1;
+    }
+    for (auto i : m_workerQueues) {
+        delete i;
+    }
+    for (auto i : m_pinnedQueues) {
+        delete i;
+    }
+    for (auto i : m_readyLists) {
+        delete i;
+    }
+    for (auto i : m_levels) {
+        delete i;
     }
 }
 
@@ -69,14 +161,29 @@ void Scheduler::start() {
     }
     m_stopping = false;
     SYLAR_ASSERT(m_threads.empty());    // no threads now
+    // 包括弹性线程在内, 每个工作线程一个专属队列
+    if (m_pinnedQueues.empty()) {
+        for (size_t i = 0; i < getMaxWorkerCount(); ++i) {
+            m_pinnedQueues.push_back(new WorkerQueue);
+            m_readyLists.push_back(new ReadyList);
+        }
+    }
     // 重设线程池大小
     m_threads.resize(m_threadCount);
     // 创建线程加入池
     for (size_t i = 0; i < m_threadCount; ++i) {    // all threads bind run
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this)
-                            , m_name + "_" + std::to_string(i)));
+        // 线程启动时先记录自己的工作线程序号
+        m_threads[i].reset(new Thread([this, i]() {
+                                t_worker_index = i;
+                                bindCpu(i);
+                                run();
+                            }, m_name + "_" + std::to_string(i)));
         m_threadIds.push_back(m_threads[i]->getId());
     }
+    if (isElastic()) {
+        m_monitor.reset(new Thread(std::bind(&Scheduler::monitor, this)
+                                    , m_name + "_monitor"));
+    }
     lock.unlock();
 
     // if (m_rootFiber) {
@@ -113,13 +220,19 @@ void Scheduler::stop() {
     }
 
     m_stopping = true;
-    // for (size_t i = 0; i < m_threadCount; ++i) {
-    //     tickle();
-    // }
+    // 监控线程看到 m_stopping 后退出, 之后不会再增加线程
+    if (m_monitor) {
+        m_monitor->join();
+        m_monitor.reset();
+    }
+    // 唤醒所有空闲线程检查是否可以退出
+    for (size_t i = 0; i < m_threadCount + m_elasticCount; ++i) {
+        tickle();
+    }
 
-    // if (m_rootFiber) {
-    //     tickle();
-    // }
+    if (m_rootFiber) {
+        tickle();
+    }
 
     // 也不知道有什么用
     // 若不能停止的话继续运行
@@ -133,6 +246,13 @@ void Scheduler::stop() {
     {
         MutexType::Lock lock(m_mutex);
         thrs.swap(m_threads);
+        for (size_t i = 0; i < m_elasticThreads.size(); ++i) {
+            if (m_elasticThreads[i]) {
+                thrs.push_back(m_elasticThreads[i]);
+                m_elasticThreads[i].reset();
+            }
+            m_elasticExited[i] = false;
+        }
     }
 
     for(auto& i : thrs) {
@@ -144,27 +264,576 @@ void Scheduler::setThis() {
     t_schedular = this;
 }
 
-// 暂时没用, 用于唤醒任务
-void Scheduler::tickle() {
-    loginfo2("tickle func");
-    loginfo2(std::to_string(sylar::GetThreadId()));
+// 基础调度器的 idle 不会阻塞, 无需唤醒, 在 IOManager 中重写
+void Scheduler::tickle(int /*thread*/) {
+}
+
+void Scheduler::setElastic(size_t max_threads, uint64_t busy_ms, uint64_t idle_ms) {
+    SYLAR_ASSERT(m_stopping && m_threads.empty());
+    m_maxThreads = max_threads;
+    m_busyThreshold = busy_ms;
+    m_idleTimeout = idle_ms;
+    size_t slots = max_threads > m_threadCount ? max_threads - m_threadCount : 0;
+    m_elasticThreads.assign(slots, nullptr);
+    m_elasticExited.assign(slots, false);
+}
+
+void Scheduler::setCpuAffinity(const std::vector<int>& cpus) {
+    SYLAR_ASSERT(m_stopping && m_threads.empty());
+    m_cpus = cpus;
+}
+
+void Scheduler::bindCpu(size_t index) {
+    if (m_cpus.empty()) {
+        return ;
+    }
+    // 先绑定再创建空闲协程, 线程的栈和缓冲区都从所在节点分配
+    Thread::SetAffinity({m_cpus[index % m_cpus.size()]});
+}
+
+Scheduler::ThreadStats Scheduler::getThreadStats() const {
+    ThreadStats stats;
+    stats.base_threads = m_threadCount;
+    stats.max_threads = m_threadCount + m_elasticThreads.size();
+    stats.threads = m_threadCount + m_elasticCount;
+    stats.active_threads = m_activeThreadCount;
+    stats.idle_threads = m_idleThreadCount;
+    stats.threads_added = m_threadsAdded;
+    stats.threads_retired = m_threadsRetired;
+    return stats;
+}
+
+int Scheduler::getWorkerThreadId(size_t index) const {
+    if (index < m_threadCount) {
+        // m_threadIds 中根线程在前, 工作线程在 start 中按序号加入
+        size_t offset = m_rootThread == -1 ? 0 : 1;
+        return index + offset < m_threadIds.size() ? m_threadIds[index + offset] : -1;
+    }
+    if (index == m_threadCount && m_rootThread != -1) {
+        return m_rootThread;
+    }
+    return -1;
+}
+
+size_t Scheduler::getMaxWorkerCount() const {
+    return getWorkerCount() + m_elasticThreads.size();
+}
+
+bool Scheduler::shouldRetire() {
+    if (getRetireTimeout() != 0) {
+        return false;
+    }
+    ++m_threadsRetired;
+    return true;
+}
+
+uint64_t Scheduler::getRetireTimeout() {
+    // 只有弹性新增的线程会退出
+    // 共享栈协程只能在绑定的线程上恢复, 还有这样的协程没有结束时线程不能退出
+    if (t_schedular != this || t_worker_index < (int)getWorkerCount()
+            || m_stopping || Fiber::GetBoundFiberCount()) {
+        return ~0ull;
+    }
+    uint64_t idle = sylar::GetMonotonicMS() - t_last_busy;
+    return idle >= m_idleTimeout ? 0 : m_idleTimeout - idle;
+}
+
+bool Scheduler::addElasticThread() {
+    for (size_t slot = 0; slot < m_elasticThreads.size(); ++slot) {
+        if (m_elasticThreads[slot]) {
+            continue;
+        }
+        int index = getWorkerCount() + slot;
+        ++m_elasticCount;
+        ++m_threadsAdded;
+        m_elasticThreads[slot].reset(new Thread([this, index, slot]() {
+                                t_worker_index = index;
+                                bindCpu(index);
+                                t_last_busy = sylar::GetMonotonicMS();
+                                run();
+                                onElasticExit(index, slot);
+                            }, m_name + "_" + std::to_string(index)));
+        return true;
+    }
+    return false;
+}
+
+void Scheduler::onElasticExit(size_t index, size_t slot) {
+    MutexType::Lock lock(m_mutex);
+    // 回收专属队列, 槽位可以给新线程使用
+    WorkerQueue* pinned = m_pinnedQueues[index];
+    TaskList fibers;
+    int thread;
+    {
+        MutexType::Lock lock2(pinned->mutex);
+        thread = pinned->thread;
+        pinned->thread = -1;
+        fibers.splice(fibers.end(), pinned->fibers);
+    }
+    // 之后指定给本线程的任务由 schedule 交给任意线程
+    m_exitedThreads.insert(thread);
+    auto it = m_threadFibers.find(thread);
+    if (it != m_threadFibers.end()) {
+        m_threadMapTaskCount -= it->second.size();
+        fibers.splice(fibers.end(), it->second);
+        m_threadFibers.erase(it);
+    }
+    // 退出前刚指定给本线程的任务交给其他线程, 否则没有线程取走, stop 等不到计数归零
+    bool added = false;
+    for (auto& ft : fibers) {
+        --m_threadTaskCount;
+        added = pushAnyTaskNoLock(ft, thread) || added;
+    }
+    m_elasticExited[slot] = true;
+    --m_elasticCount;
+    lock.unlock();
+    if (added && hasIdleThreads()) {
+        tickle();
+    }
+}
+
+bool Scheduler::pushAnyTaskNoLock(FiberAndThread& ft, int thread) {
+    // 空闲超时的线程上没有未结束的共享栈协程, 这里只会是已经结束的协程, 直接丢弃
+    if (ft.fiber && ft.fiber->getBoundThread() == thread) {
+        SYLAR_ASSERT(ft.fiber->getState() == Fiber::TERM
+                || ft.fiber->getState() == Fiber::EXCEPT);
+        return false;
+    }
+    LevelQueue* level = m_levels[PRIORITY_NORMAL];
+    ft.thread = -1;
+    ft.prio = PRIORITY_NORMAL;
+    ++level->count;
+    ++m_anyTaskCount;
+    pushTaskNoLock(level->fibers, m_spareTasks, ft);
+    return true;
+}
+
+void Scheduler::monitor() {
+    // 检查间隔取忙碌阈值的四分之一, 在 1ms 到 50ms 之间
+    uint64_t interval = std::min<uint64_t>(std::max<uint64_t>(m_busyThreshold / 4, 1), 50);
+    uint64_t busy_since = 0;
+    while (!m_stopping) {
+        usleep(interval * 1000);
+        // join 已经退出的弹性线程, 空出槽位
+        std::vector<Thread::ptr> exited;
+        {
+            MutexType::Lock lock(m_mutex);
+            for (size_t i = 0; i < m_elasticExited.size(); ++i) {
+                if (m_elasticExited[i]) {
+                    exited.push_back(m_elasticThreads[i]);
+                    m_elasticThreads[i].reset();
+                    m_elasticExited[i] = false;
+                }
+            }
+        }
+        for (auto& i : exited) {
+            i->join();
+        }
+        // 所有线程都在执行任务, 并且还有其他线程可以执行的任务在排队
+        // 指定了线程的任务不会因为增加线程而更快执行, 不计算在内
+        bool saturated = m_activeThreadCount >= m_threadCount + m_elasticCount
+                        && m_anyTaskCount + m_localTaskCount > 0;
+        if (!saturated) {
+            busy_since = 0;
+            continue;
+        }
+        uint64_t now = sylar::GetMonotonicMS();
+        if (!busy_since) {
+            busy_since = now;
+        } else if (now - busy_since >= m_busyThreshold) {
+            MutexType::Lock lock(m_mutex);
+            if (!m_stopping && addElasticThread()) {
+                loginfo2("all threads are busy, add a thread");
+            }
+            busy_since = 0;
+        }
+    }
+}
+
+int Scheduler::GetWorkerIndex() {
+    return t_worker_index;
+}
+
+void Scheduler::onWakeup() {
+    t_woken = true;
+    ++m_wakeupCount;
+}
+
+Fiber::ptr Scheduler::newCbFiber(std::vector<Fiber::ptr>& pool, Task& cb) {
+    if (!pool.empty()) {
+        Fiber::ptr fiber = std::move(pool.back());
+        pool.pop_back();
+        fiber->reset(std::move(cb));
+        ++m_fiberReuseCount;
+        return fiber;
+    }
+    ++m_fiberCreateCount;
+    return Fiber::ptr(new Fiber(std::move(cb), m_stackSize, false, m_sharedStack));
+}
+
+void Scheduler::recycleFiber(std::vector<Fiber::ptr>& pool, Fiber::ptr& fiber) {
+    // 还有其他地方持有的协程不能复用
+    if (fiber.use_count() != 1 || pool.size() >= m_fiberPoolSize) {
+        return ;
+    }
+    // 只复用和本调度器新建协程同样配置的协程
+    if (fiber->isSharedStack() != m_sharedStack) {
+        return ;
+    }
+    if (!m_sharedStack && fiber->getStackSize() 
+            != (m_stackSize ? m_stackSize : Fiber::GetDefaultStackSize())) {
+        return ;
+    }
+    // 释放函数绑定的资源
+    fiber->reset(nullptr);
+    pool.push_back(std::move(fiber));
+}
+
+void Scheduler::tickleThreadTasks() {
+    std::vector<int> threads;
+    for (auto pinned : m_pinnedQueues) {
+        int thread = pinned->thread;
+        if (thread == -1 || thread == sylar::GetThreadId()) {
+            continue;
+        }
+        MutexType::Lock lock(pinned->mutex);
+        if (!pinned->fibers.empty()) {
+            threads.push_back(thread);
+        }
+    }
+    if (m_threadMapTaskCount > 0) {
+        MutexType::Lock lock(m_mutex);
+        for (auto& i : m_threadFibers) {
+            if (!i.second.empty() && i.first != sylar::GetThreadId()) {
+                threads.push_back(i.first);
+            }
+        }
+    }
+    for (auto thread : threads) {
+        tickle(thread);
+    }
+}
+
+bool Scheduler::hasPendingTask() {
+    if (m_anyTaskCount > 0 || m_localTaskCount > 0) {
+        return true;
+    }
+    if (m_threadTaskCount == 0) {
+        return false;
+    }
+    WorkerQueue* pinned = getPinnedQueue(sylar::GetThreadId());
+    if (pinned) {
+        MutexType::Lock lock(pinned->mutex);
+        if (!pinned->fibers.empty()) {
+            return true;
+        }
+    }
+    if (m_threadMapTaskCount == 0) {
+        return false;
+    }
+    MutexType::Lock lock(m_mutex);
+    auto it = m_threadFibers.find(sylar::GetThreadId());
+    return it != m_threadFibers.end() && !it->second.empty();
 }
 
 bool Scheduler::stopping() {
     MutexType::Lock lock(m_mutex);
     return m_autoStop && m_stopping 
-        && m_fibers.empty() && m_activeThreadCount == 0;
+        && m_anyTaskCount == 0 && m_threadTaskCount == 0
+        && m_localTaskCount == 0
+        && m_activeThreadCount == 0;
+}
+
+Scheduler::WorkerQueue* Scheduler::getLocalQueue() {
+    if (!m_workStealing || t_schedular != this || t_worker_index < 0
+            || t_worker_index >= (int)m_workerQueues.size()) {
+        return nullptr;
+    }
+    return m_workerQueues[t_worker_index];
+}
+
+Scheduler::WorkerQueue* Scheduler::getPinnedQueue(int thread) {
+    // 工作线程调度给自己的任务最常见, 先查自己的队列
+    if (t_schedular == this && t_worker_index >= 0
+            && t_worker_index < (int)m_pinnedQueues.size()
+            && m_pinnedQueues[t_worker_index]->thread == thread) {
+        return m_pinnedQueues[t_worker_index];
+    }
+    for (auto pinned : m_pinnedQueues) {
+        if (pinned->thread == thread) {
+            return pinned;
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::ReadyList* Scheduler::getReadyList() {
+    if (t_schedular != this || t_worker_index < 0
+            || t_worker_index >= (int)m_readyLists.size()) {
+        return nullptr;
+    }
+    return m_readyLists[t_worker_index];
+}
+
+bool Scheduler::takeReadyTask(FiberAndThread& ft) {
+    ReadyList* ready = getReadyList();
+    if (!ready || ready->head == ready->tasks.size()) {
+        return false;
+    }
+    ft = std::move(ready->tasks[ready->head++]);
+    if (ready->head == ready->tasks.size()) {
+        ready->tasks.clear();
+        ready->head = 0;
+    }
+    ++m_activeThreadCount;
+    return true;
+}
+
+// 每个队列保留的空节点上限
+static const size_t s_max_spare_tasks = 1024;
+
+bool Scheduler::takeTask(TaskList& fibers, TaskList& spare, FiberAndThread& ft
+                        , bool from_back) {
+    if (from_back) {
+        // 窃取时从队尾开始找, 与队列拥有者错开
+        for (auto it = fibers.rbegin(); it != fibers.rend(); ++it) {
+            if (it->thread != -1 && it->thread != sylar::GetThreadId()) {
+                continue;
+            }
+            if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
+                continue;
+            }
+            ft = std::move(*it);
+            releaseTaskNode(fibers, spare, std::next(it).base());
+            return true;
+        }
+        return false;
+    }
+    auto it = fibers.begin();
+    // 遍历任务列表
+    while (it != fibers.end()) {
+        // it->thread 为 -1 表示任意线程, 可以执行
+        // 不为当前线程 id, 表示不属于当前线程, 跳过
+        // ++it 在指定线程 id 的情况下生效
+        if (it->thread != -1 && it->thread != sylar::GetThreadId()) {
+            ++it;
+            //tickle_me == true;
+            continue;
+        }
+        // 判断是否有任务
+        SYLAR_ASSERT(it->fiber || it->cb);
+        // 若是协程且已在执, 跳过
+        if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
+            ++it;
+            continue;
+        }
+        // 绑定任务
+        ft = std::move(*it);
+        releaseTaskNode(fibers, spare, it);
+        return true;
+    }
+    return false;
+}
+
+void Scheduler::pushTaskNoLock(TaskList& fibers, TaskList& spare, FiberAndThread& ft) {
+    if (spare.empty()) {
+        fibers.push_back(std::move(ft));
+    } else {
+        spare.front() = std::move(ft);
+        fibers.splice(fibers.end(), spare, spare.begin());
+    }
+}
+
+void Scheduler::injectTask(FiberAndThread& ft, Priority prio) {
+    LevelQueue* level = m_levels[prio];
+    ft.prio = prio;
+    // 先加计数再入队, 空闲线程看到计数为 0 时队列一定为空
+    ++level->count;
+    ++m_anyTaskCount;
+    if (!level->inject.tryPush(ft)) {
+        ++m_injectOverflows;
+        MutexType::Lock lock(m_mutex);
+        pushTaskNoLock(level->fibers, m_spareTasks, ft);
+    }
+}
+
+bool Scheduler::takeInjectTask(FiberAndThread& ft, Priority prio, WorkerQueue* local) {
+    LevelQueue* level = m_levels[prio];
+    while (level->inject.tryPop(ft)) {
+        // 协程还没有切出, 不能执行, 放到加锁的队列中等待
+        if (ft.fiber && ft.fiber->getState() == Fiber::EXEC) {
+            MutexType::Lock lock(m_mutex);
+            pushTaskNoLock(level->fibers, m_spareTasks, ft);
+            ft.reset();
+            continue;
+        }
+        // 先标记活跃再减计数, stopping 不会在中间看到空闲
+        ++m_activeThreadCount;
+        --level->count;
+        --m_anyTaskCount;
+        // 只有普通任务可以搬到本地队列, 其他优先级的任务留在公共队列中按优先级取
+        if (!local || prio != PRIORITY_NORMAL) {
+            return true;
+        }
+        // 工作窃取模式下一次搬走一批, 减少对注入队列的争用, 多出的任务可以被其他线程窃取
+        size_t moved = 0;
+        {
+            MutexType::Lock lock(local->mutex);
+            FiberAndThread next;
+            while (moved < s_inject_batch && level->inject.tryPop(next)) {
+                ++m_localTaskCount;
+                --level->count;
+                --m_anyTaskCount;
+                pushTaskNoLock(local->fibers, local->spare, next);
+                ++moved;
+            }
+        }
+        if (moved && hasIdleThreads()) {
+            tickle();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool Scheduler::takeLevelTask(FiberAndThread& ft, Priority prio, WorkerQueue* local) {
+    if (prio == PRIORITY_NORMAL) {
+        // 工作窃取模式下先取本地队列
+        if (local) {
+            MutexType::Lock lock(local->mutex);
+            if (takeTask(local->fibers, local->spare, ft)) {
+                --m_localTaskCount;
+                ++m_activeThreadCount;
+                return true;
+            }
+        }
+        // 再取指定给本线程的任务, 只锁本线程的专属队列
+        if (m_threadTaskCount > 0) {
+            WorkerQueue* pinned = getPinnedQueue(sylar::GetThreadId());
+            if (pinned) {
+                MutexType::Lock lock(pinned->mutex);
+                if (takeTask(pinned->fibers, pinned->spare, ft)) {
+                    --m_threadTaskCount;
+                    ++m_activeThreadCount;
+                    return true;
+                }
+            }
+        }
+        // 专属队列创建之前指定的任务, 需要加调度器的锁
+        if (m_threadMapTaskCount > 0) {
+            MutexType::Lock lock(m_mutex);
+            auto it = m_threadFibers.find(sylar::GetThreadId());
+            if (it != m_threadFibers.end() && takeTask(it->second, m_spareTasks, ft)) {
+                --m_threadMapTaskCount;
+                --m_threadTaskCount;
+                ++m_activeThreadCount;
+                return true;
+            }
+        }
+    }
+    LevelQueue* level = m_levels[prio];
+    if (level->count == 0) {
+        return false;
+    }
+    // 注入队列不需要加锁, 只有溢出或暂时不能执行的任务才在 fibers 中
+    if (takeInjectTask(ft, prio, local)) {
+        return true;
+    }
+    MutexType::Lock lock(m_mutex);
+    if (takeTask(level->fibers, m_spareTasks, ft)) {
+        --level->count;
+        --m_anyTaskCount;
+        ++m_activeThreadCount;
+        return true;
+    }
+    return false;
+}
+
+bool Scheduler::nextTask(FiberAndThread& ft, WorkerQueue* local) {
+    static const Priority s_orders[2][PRIORITY_COUNT] = {
+        {PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW},
+        // 防止饿死, 每隔一段先取低优先级的任务
+        {PRIORITY_LOW, PRIORITY_NORMAL, PRIORITY_HIGH},
+    };
+    bool fair = m_fairInterval && ++t_dispatch_count % m_fairInterval == 0;
+    for (auto prio : s_orders[fair]) {
+        if (takeLevelTask(ft, prio, local)) {
+            return true;
+        }
+    }
+    // 本地和全局队列都没有任务, 去其他线程的队列窃取
+    if (m_workStealing && m_localTaskCount > 0 && stealTask(ft, local)) {
+        --m_localTaskCount;
+        ++m_activeThreadCount;
+        return true;
+    }
+    return false;
+}
+
+size_t Scheduler::getQueueDepth(Priority prio) const {
+    size_t depth = m_levels[prio]->count;
+    if (prio == PRIORITY_NORMAL) {
+        depth += m_localTaskCount + m_threadTaskCount;
+    }
+    return depth;
+}
+
+void Scheduler::releaseTaskNode(TaskList& fibers, TaskList& spare, TaskList::iterator it) {
+    if (spare.size() < s_max_spare_tasks) {
+        it->reset();
+        spare.splice(spare.end(), fibers, it);
+    } else {
+        fibers.erase(it);
+    }
+}
+
+bool Scheduler::stealTask(FiberAndThread& ft, WorkerQueue* local) {
+    size_t count = m_workerQueues.size();
+    // 弹性线程没有本地队列, 所有队列都可以窃取
+    size_t self = local ? t_worker_index : count - 1;
+    for (size_t i = local ? 1 : 0; i < count; ++i) {
+        WorkerQueue* victim = m_workerQueues[(self + i) % count];
+        TaskList stolen;
+        {
+            MutexType::Lock lock(victim->mutex);
+            if (!takeTask(victim->fibers, victim->spare, ft, true)) {
+                continue;
+            }
+            if (!local) {
+                return true;
+            }
+            // 一次窃取对方剩余任务的一半, 减少反复窃取的加锁次数
+            size_t half = victim->fibers.size() / 2;
+            auto it = victim->fibers.end();
+            std::advance(it, -(long)half);
+            stolen.splice(stolen.end(), victim->fibers, it, victim->fibers.end());
+        }
+        if (!stolen.empty()) {
+            MutexType::Lock lock(local->mutex);
+            local->fibers.splice(local->fibers.end(), stolen);
+        }
+        return true;
+    }
+    return false;
 }
 
 // 在 IOManager 中重写了这个函数
 void Scheduler::idle() {
     loginfo2("the idle fiber has no task to do");
-    while (!stopping()) {
+    while (!stopping() && !shouldRetire()) {
         // 让出执行权, 回到run的循环继续检查有无任务
         sylar::Fiber::YieldToHold();
     }
 }
 
+void Scheduler::releaseRun(const Fiber::ptr& fiber) {
+    if (fiber->releaseRun()) {
+        // 切出期间被唤醒的协程, 取到它的线程没有换入, 在这里按唤醒时的目标重新调度
+        fiber->m_wakeScheduler->schedule(fiber, (Priority)fiber->m_wakePrio
+                                        , fiber->m_wakeThread);
+    }
+}
+
 void Scheduler::run() {
     set_hook_enable(true);
     setThis();
@@ -174,47 +843,35 @@ void Scheduler::run() {
         // 设置调度协程为线程空间内唯一的主协程
         t_scheduler_fiber = Fiber::GetThis().get();
     }
+    // 定时器等热路径读缓存的时钟
+    UpdateCoarseClock();
+    // 开始接收指定给本线程的任务
+    if (t_worker_index >= 0 && t_worker_index < (int)m_pinnedQueues.size()) {
+        MutexType::Lock lock(m_mutex);
+        // 线程 id 可能被复用
+        m_exitedThreads.erase(sylar::GetThreadId());
+        m_pinnedQueues[t_worker_index]->thread = sylar::GetThreadId();
+    }
     // 分配一个空闲时的协程
-    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this), m_stackSize));
     // 分配一个执行函数用的协程
     Fiber::ptr cb_fiber;
+    // 本线程已结束的协程池, 线程退出时随之释放
+    std::vector<Fiber::ptr> fiber_pool;
     // 分配一个任务
     FiberAndThread ft;
+    // 上次空闲之后是否执行过任务
+    bool worked = false;
     // 接下来一直运行这个 while 循环
     // 直到空闲时的协程为结束态
     while (true) {
         ft.reset();
         //bool tickle_me = false;
-        bool is_active = false;
-        {
-            // 加锁寻找需要调度执行的任务
-            MutexType::Lock lock(m_mutex);
-            auto it = m_fibers.begin();
-            // 遍历任务列表
-            while (it != m_fibers.end()) {
-                // it->thread 为 -1 表示任意线程, 可以执行
-                // 不为当前线程 id, 表示不属于当前线程, 跳过
-                // ++it 在指定线程 id 的情况下生效
-                if (it->thread != -1 && it->thread != sylar::GetThreadId()) {
-                    ++it;
-                    //tickle_me == true;
-                    continue;
-                }
-                // 判断是否有任务
-                SYLAR_ASSERT(it->fiber || it->cb);
-                // 若是协程且已在执, 跳过
-                if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
-                    ++it;
-                    continue;
-                }
-                // 绑定任务
-                ft = *it;
-                m_fibers.erase(it);
-                ++m_activeThreadCount;
-                is_active = true;
-                break;
-            }
-            //tickle_me |= it != m_fibers.end();
+        // 先取本线程反应器唤醒的任务, 再按优先级取一个任务
+        bool is_active = takeReadyTask(ft) || nextTask(ft, getLocalQueue());
+        if (is_active) {
+            t_woken = false;
+            worked = true;
         }
 
         // if (tickle_me) {
@@ -225,16 +882,30 @@ void Scheduler::run() {
         // 这个逻辑判断是不是一直为真
         if (ft.fiber && (ft.fiber->getState() != Fiber::TERM
                         || ft.fiber->getState() != Fiber::EXCEPT)) {
+            // 原线程还在处理它的切出, 不换入, 由原线程处理完后重新调度
+            if (!ft.fiber->acquireRun(this, ft.thread, ft.prio)) {
+                --m_activeThreadCount;
+                continue;
+            }
             // 进入协程上下文执行
             ft.fiber->swapIn();
             // 执行完毕
             --m_activeThreadCount;
+            UpdateCoarseClock();
+            onTaskYield();
             // 若为就绪态, 接着调度
+            // 状态处理完之后其他线程才能换入
             if (ft.fiber->getState() == Fiber::READY) {
-                schedule(ft.fiber);
+                releaseRun(ft.fiber);
+                schedule(ft.fiber, ft.prio);
             } else if (ft.fiber->getState() != Fiber::TERM
                         && ft.fiber->getState() != Fiber::EXCEPT) {
                 ft.fiber->m_state = Fiber::HOLD;
+                releaseRun(ft.fiber);
+            } else {
+                releaseRun(ft.fiber);
+                // 由 cb_fiber 切出去的协程结束后在这里回收
+                recycleFiber(fiber_pool, ft.fiber);
             }
             // 初始化为空
             ft.reset();
@@ -242,26 +913,34 @@ void Scheduler::run() {
             // 需要执行的是函数
             if (cb_fiber) {
                 // 协程重新绑定函数
-                cb_fiber->reset(ft.cb);
+                cb_fiber->reset(std::move(ft.cb));
             } else {
-                // 新建线程执行
-                cb_fiber.reset(new Fiber(ft.cb));
+                // 从协程池中取或者新建协程执行
+                cb_fiber = newCbFiber(fiber_pool, ft.cb);
             }
+            Priority prio = ft.prio;
             // 任务重设为空
             ft.reset();
-            // 进入绑定了函数的上下文执行
+            // 进入绑定了函数的上下文执行, 本线程的 cb_fiber 不会被其他线程占用
+            cb_fiber->acquireRun(this, -1, prio);
             cb_fiber->swapIn();
             // 执行完毕
             --m_activeThreadCount;
+            UpdateCoarseClock();
+            onTaskYield();
             // 同上
+            // 放弃 cb_fiber 的引用之前释放
             if (cb_fiber->getState() == Fiber::READY) {
-                schedule(cb_fiber);
+                releaseRun(cb_fiber);
+                schedule(cb_fiber, prio);
                 cb_fiber.reset();
             } else if (cb_fiber->getState() == Fiber::EXCEPT
                         || cb_fiber->getState() == Fiber::TERM) {
                 cb_fiber->reset(nullptr);
+                releaseRun(cb_fiber);
             } else {//if (cb_fiber->getState() != Fiber::TERM) {
                 cb_fiber->m_state = Fiber::HOLD;
+                releaseRun(cb_fiber);
                 cb_fiber.reset();
             }
         } else {
@@ -271,11 +950,25 @@ void Scheduler::run() {
                 --m_activeThreadCount;
                 continue;
             }
+            // 被唤醒却没有取到任务, 记为一次无效唤醒
+            if (t_woken) {
+                ++m_spuriousWakeups;
+                t_woken = false;
+                // 唤醒可能被其他线程收到, 把指定了线程的任务的唤醒转交出去
+                if (m_threadTaskCount > 0) {
+                    tickleThreadTasks();
+                }
+            }
             // 若空闲进程运行结束, 也就是收到了 stop 信号
             if (idle_fiber->getState() == Fiber::TERM) {
                 loginfo2("idle fiber is term, this thread is about to exit");
                 break;
             }
+            // 记录最后忙碌的时间, 弹性线程空闲超时后退出
+            if (worked) {
+                t_last_busy = sylar::GetMonotonicMS();
+                worked = false;
+            }
             // 进程空闲, 进入等待
             ++m_idleThreadCount;
             // idle_fiber 会持续等待
@@ -288,6 +981,8 @@ void Scheduler::run() {
             }
         }
     }
+    // 离开调度器后不再有人刷新
+    ClearCoarseClock();
 }
 
 }
\ No newline at end of file
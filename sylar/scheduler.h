@@ -4,8 +4,13 @@
 #include <memory>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include "fiber.h"
+#include "task.h"
+#include "mpmc_queue.h"
 #include "thread.h"
+#include "macro.h"
 
 namespace sylar {
 
@@ -15,12 +20,68 @@ public:
     typedef std::shared_ptr<Scheduler> ptr;
     // 设置锁
     typedef Mutex MutexType;
+    // 固定到调用线程执行的标记, 用于 schedule 的重载
+    enum ThreadAffinity {
+        THIS_THREAD,
+    };
+    // 任务优先级, 空闲线程按 高 -> 普通 -> 低 的顺序取任务
+    enum Priority {
+        PRIORITY_HIGH = 0,
+        PRIORITY_NORMAL = 1,
+        PRIORITY_LOW = 2,
+        PRIORITY_COUNT = 3,
+    };
+    // 线程数量的统计
+    struct ThreadStats {
+        // 构造时指定的线程数, 不包括 use_caller 的根线程
+        size_t base_threads = 0;
+        // 弹性模式下允许的最大线程数, 非弹性模式等于 base_threads
+        size_t max_threads = 0;
+        // 当前运行中的线程数
+        size_t threads = 0;
+        // 正在执行任务的线程数
+        size_t active_threads = 0;
+        // 空闲的线程数
+        size_t idle_threads = 0;
+        // 弹性扩容新增的线程总数
+        uint64_t threads_added = 0;
+        // 空闲超时退出的线程总数
+        uint64_t threads_retired = 0;
+    };
     // 带参构造
+    // work_stealing 为 true 时每个工作线程拥有自己的任务队列, 空闲时从其他线程窃取任务
+    // 为 false 时所有线程共用公共任务队列
     Scheduler(size_t threads = 2, bool use_caller = true, 
-                const std::string name = "");
+                const std::string name = "", bool work_stealing = false);
     virtual ~Scheduler();
     // 获取调度器名称
     const std::string& getName() { return m_name; }
+    // 是否为工作窃取模式
+    bool isWorkStealing() const { return m_workStealing; }
+    // 调度器创建的协程使用的栈大小, 0 表示使用 fiber.stack_size
+    uint32_t getStackSize() const { return m_stackSize; }
+    void setStackSize(uint32_t v) { m_stackSize = v; }
+    // 调度器为回调函数创建的协程是否运行在共享栈上
+    bool isSharedStack() const { return m_sharedStack; }
+    void setSharedStack(bool v) { m_sharedStack = v; }
+    // 每个线程缓存的已结束协程的上限, 0 表示不缓存
+    uint32_t getFiberPoolSize() const { return m_fiberPoolSize; }
+    void setFiberPoolSize(uint32_t v) { m_fiberPoolSize = v; }
+    // 弹性模式: 所有线程忙碌且有任务排队超过 busy_ms 时增加线程, 直到 max_threads
+    // 新增的线程空闲超过 idle_ms 后退出, 只能在 start 之前设置
+    // IOManager 在构造时启动, 通过配置 scheduler.max_threads 开启
+    void setElastic(size_t max_threads, uint64_t busy_ms, uint64_t idle_ms);
+    bool isElastic() const { return m_maxThreads > m_threadCount; }
+    // 工作线程绑定的 CPU, 第 i 个线程绑定到 cpus[i % cpus.size()], 为空时不绑定
+    // use_caller 的根线程不绑定, 只能在 start 之前设置
+    // IOManager 在构造时启动, 通过配置 scheduler.cpu_affinity 设置
+    const std::vector<int>& getCpuAffinity() const { return m_cpus; }
+    void setCpuAffinity(const std::vector<int>& cpus);
+    // 线程数量的统计
+    ThreadStats getThreadStats() const;
+    // 第 index 个工作线程的线程 id, 用于把任务固定到某个线程, 不存在时返回 -1
+    // 序号不包括弹性线程, use_caller 时根线程排在最后
+    int getWorkerThreadId(size_t index) const;
     // 获取当前调度器
     static Scheduler* GetThis();
     // 获取调度器的调度协程
@@ -32,40 +93,146 @@ public:
     // 模板类, 用于调度新的协程或者函数
     template<class FiberOrCb>
     void schedule(FiberOrCb fc, int thread = -1) {
-        bool need_tickle = false;
-        {
-            // 在这里上锁, 就不需要在加入调度时上锁了
-            MutexType::Lock lock(m_mutex);
-            // 将协程或者函数加入调度
-            // 这里的 thread 都默认为-1, 表示任意线程均可执行
-            // 也是后续优化的地方
-            need_tickle = scheduleNoLock(fc, thread);
+        schedule(std::move(fc), PRIORITY_NORMAL, thread);
+    }
+    // 按优先级调度, 指定了线程的任务不区分优先级
+    template<class FiberOrCb>
+    void schedule(FiberOrCb fc, Priority prio, int thread = -1) {
+        // 共享栈协程只能回到它绑定的线程上执行
+        if (thread == -1) {
+            thread = BoundThread(fc);
         }
-
-        // if (need_tickle) {
-        //     tickle();
-        // }
+        // 工作窃取模式下, 工作线程内调度的普通任务直接放入本线程的队列
+        WorkerQueue* local = thread == -1 && prio == PRIORITY_NORMAL 
+                                ? getLocalQueue() : nullptr;
+        // 指定给工作线程的任务放入该线程的专属队列, 只锁该队列
+        WorkerQueue* pinned = thread != -1 ? getPinnedQueue(thread) : nullptr;
+        if (local) {
+            MutexType::Lock lock(local->mutex);
+            if (!scheduleNoLock(local->fibers, local->spare, std::move(fc), thread)) {
+                return ;
+            }
+            ++m_localTaskCount;
+        } else if (thread == -1) {
+            // thread 为 -1 表示任意线程均可执行, 放入无锁的注入队列
+            FiberAndThread ft(std::move(fc), thread);
+            if (!ft.fiber && !ft.cb) {
+                return ;
+            }
+            injectTask(ft, prio);
+        } else {
+            if (pinned) {
+                MutexType::Lock lock(pinned->mutex);
+                // 查找队列之后线程可能已经退出, 队列被回收, 此时按线程 id 处理
+                if (pinned->thread != thread) {
+                    pinned = nullptr;
+                } else if (!scheduleNoLock(pinned->fibers, pinned->spare, std::move(fc), thread)) {
+                    return ;
+                } else {
+                    ++m_threadTaskCount;
+                }
+            }
+            if (!pinned) {
+                // 在这里上锁, 就不需要在加入调度时上锁了
+                MutexType::Lock lock(m_mutex);
+                if (m_exitedThreads.count(thread)) {
+                    // 弹性线程已经退出, 交给任意线程执行
+                    FiberAndThread ft(std::move(fc), -1);
+                    if (!pushAnyTaskNoLock(ft, thread)) {
+                        return ;
+                    }
+                    thread = -1;
+                } else if (!scheduleNoLock(m_threadFibers[thread], m_spareTasks, std::move(fc), thread)) {
+                    // 线程还没开始调度时放入按线程 id 分开的队列, 取任务时无需跳过
+                    return ;
+                } else {
+                    ++m_threadTaskCount;
+                    ++m_threadMapTaskCount;
+                }
+            }
+        }
+        // 每入队一个任务最多唤醒一个空闲线程
+        // 计数在唤醒之前更新, 与 idle 中先置空闲标记再检查计数的顺序配合, 不会丢失唤醒
+        if (hasIdleThreads()) {
+            tickle(thread);
+        }
+    }
+    // 放入当前工作线程的就绪列表, 本线程下一次取任务时最先执行, 不加锁也不唤醒其他线程
+    // 用于本线程的反应器唤醒的协程和回调, 数据留在本线程的缓存中
+    // 当前线程不是此调度器的工作线程, 或者任务必须在其他线程执行时返回 false, fc 保持不变
+    // 本线程已经攒了就绪任务而其他线程空闲时也返回 false, 一批事件由空闲线程分担
+    template<class FiberOrCb>
+    bool scheduleLocal(FiberOrCb fc, int thread = -1) {
+        ReadyList* ready = getReadyList();
+        if (!ready || (ready->head != ready->tasks.size() && hasIdleThreads())) {
+            return false;
+        }
+        if (thread == -1) {
+            thread = BoundThread(fc);
+        }
+        if (thread != -1 && thread != sylar::GetThreadId()) {
+            return false;
+        }
+        FiberAndThread ft(std::move(fc), -1);
+        if (ft.fiber || ft.cb) {
+            ready->tasks.push_back(std::move(ft));
+        }
+        return true;
+    }
+    // 调度到调用线程执行, 只能在此调度器的工作线程中调用
+    template<class FiberOrCb>
+    void schedule(FiberOrCb fc, ThreadAffinity) {
+        SYLAR_ASSERT(GetThis() == this);
+        schedule(std::move(fc), sylar::GetThreadId());
     }
     // 模板类, 用于批量添加需要调度的内容(协程或者函数)
     template<class InputIterator>
-    void schedule(InputIterator begin, InputIterator end) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
+    void schedule(InputIterator begin, InputIterator end
+                    , Priority prio = PRIORITY_NORMAL) {
+        size_t count = 0;
+        WorkerQueue* local = prio == PRIORITY_NORMAL ? getLocalQueue() : nullptr;
+        if (local) {
+            MutexType::Lock lock(local->mutex);
             while (begin != end) {
-                need_tickle = scheduleNoLock(&*begin, -1);
+                count += scheduleNoLock(local->fibers, local->spare, &*begin, -1);
+                ++begin;
+            }
+            m_localTaskCount += count;
+        } else {
+            // 定时器和 IO 事件的回调从这里批量加入, 不占用调度器的锁
+            while (begin != end) {
+                FiberAndThread ft(&*begin, -1);
+                if (ft.fiber || ft.cb) {
+                    injectTask(ft, prio);
+                    ++count;
+                }
                 ++begin;
             }
         }
-        // if (need_tickle) {
-        //     tickle();
-        // }
+        for (size_t i = 0; i < count && hasIdleThreads(); ++i) {
+            tickle();
+        }
     }
+    // 被 tickle 唤醒的次数
+    uint64_t getWakeupCount() const { return m_wakeupCount; }
+    // 被唤醒后没有取到任务的次数
+    uint64_t getSpuriousWakeups() const { return m_spuriousWakeups; }
+    // 注入队列已满, 退回加锁的公共队列的次数
+    uint64_t getInjectOverflows() const { return m_injectOverflows; }
+    // 某个优先级排队中的任务数, 普通优先级包含本地队列和指定了线程的任务
+    size_t getQueueDepth(Priority prio) const;
+    // 低优先级任务最多连续被跳过的次数, 超过后先取低优先级任务, 防止饿死
+    uint32_t getFairInterval() const { return m_fairInterval; }
+    void setFairInterval(uint32_t v) { m_fairInterval = v; }
+    // 从协程池中复用协程的次数
+    uint64_t getFiberReuseCount() const { return m_fiberReuseCount; }
+    // 因协程池为空而新建协程的次数
+    uint64_t getFiberCreateCount() const { return m_fiberCreateCount; }
 protected:
     // 调度的核心函数, 在 run 中进行一系列的调度操作
     void run();
-    // 唤醒函数, 目前没发现有什么用, 可后续优化
-    virtual void tickle();
+    // 唤醒一个空闲的线程, thread 不为 -1 时优先唤醒该线程
+    virtual void tickle(int thread = -1);
     // 判断是否需要停止调度
     virtual bool stopping();
     // 没有任务需要调度, 空闲时执行的函数
@@ -74,44 +241,104 @@ protected:
     void setThis();
     // 是否有空闲的线程, 若 有 返回 真 
     bool hasIdleThreads() { return m_idleThreadCount > 0;}
+    // 是否有当前线程可以执行的排队任务, 空闲线程阻塞前用于复查
+    bool hasPendingTask();
+    // 工作线程总数, use_caller 时包含根线程, 不包括弹性新增的线程
+    size_t getWorkerCount() const { return m_threadCount + (m_rootThread == -1 ? 0 : 1); }
+    // 包括弹性线程在内最多的工作线程数, 弹性线程的序号排在 getWorkerCount 之后
+    size_t getMaxWorkerCount() const;
+    // 当前线程是弹性新增的且空闲超时, 空闲协程应当结束让线程退出
+    bool shouldRetire();
+    // 距离当前线程空闲超时还有多少毫秒, 不会退出的线程返回 ~0ull
+    uint64_t getRetireTimeout();
+    // 当前线程在调度器中的工作线程序号, 非工作线程返回 -1
+    static int GetWorkerIndex();
+    // 记录当前线程被 tickle 唤醒, 用于统计无效唤醒
+    void onWakeup();
+    // 任务切回调度协程之后调用, IOManager 在这里批量提交 io_uring 请求
+    virtual void onTaskYield() {}
 private:
+    struct FiberAndThread;
+    struct WorkerQueue;
+    typedef std::list<FiberAndThread> TaskList;
+    // 协程绑定的线程, 函数可以在任意线程执行
+    static int BoundThread(const Fiber::ptr& f) { return f ? f->getBoundThread() : -1; }
+    static int BoundThread(Fiber::ptr* f) { return *f ? (*f)->getBoundThread() : -1; }
+    template<class Cb>
+    static int BoundThread(const Cb&) { return -1; }
+    // 被唤醒的线程没有取到任务时, 把唤醒转交给有指定任务的线程
+    void tickleThreadTasks();
+    // 弹性模式的监控线程, 决定何时增加线程, 回收已退出的线程
+    void monitor();
+    // 在空闲的槽位上增加一个线程, 调用方持有 m_mutex
+    bool addElasticThread();
+    // 弹性线程退出 run 之后调用, index 为工作线程序号
+    void onElasticExit(size_t index, size_t slot);
+    // 工作线程启动时绑定 CPU
+    void bindCpu(size_t index);
+    // 从线程的协程池中取一个协程执行函数, 池为空时新建
+    Fiber::ptr newCbFiber(std::vector<Fiber::ptr>& pool, Task& cb);
+    // 已结束且没有其他引用的协程放回线程的协程池
+    void recycleFiber(std::vector<Fiber::ptr>& pool, Fiber::ptr& fiber);
+    // 处理完切出的协程后释放占用, 切出期间被唤醒过的重新调度
+    void releaseRun(const Fiber::ptr& fiber);
     // 模板类, 添加需要调度的函数或者协程
+    // 调用方负责给 fibers 所在的队列加锁
+    // 返回是否真正加入了任务, 空的协程或函数不会入队
     template<class FiberOrCb> 
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        // need_tickle 不知道什么作用
-        // 判断任务池是否为空
-        bool need_tickle = m_fibers.empty();
+    bool scheduleNoLock(TaskList& fibers, TaskList& spare, FiberOrCb fc, int thread) {
         // 创建一个任务对象
-        FiberAndThread ft(fc, thread);
-        if (ft.fiber || ft.cb) {
-            // 将任务对象添加进任务池中
-            m_fibers.push_back(ft);
+        FiberAndThread ft(std::move(fc), thread);
+        if (!ft.fiber && !ft.cb) {
+            return false;
         }
-        return need_tickle;
+        // 将任务对象添加进任务池中
+        pushTaskNoLock(fibers, spare, ft);
+        return true;
     }
+    // 优先复用 spare 中的链表节点, 入队不再分配内存
+    void pushTaskNoLock(TaskList& fibers, TaskList& spare, FiberAndThread& ft);
+    // 任务放入对应优先级的注入队列, 队列满时加锁放入该优先级的 fibers
+    void injectTask(FiberAndThread& ft, Priority prio);
+    // 指定给已退出线程 thread 的任务改为任意线程执行, 放入普通优先级的 fibers, 调用方持有 m_mutex
+    // 绑定在该线程上的协程只会是已经结束的, 丢弃并返回 false
+    bool pushAnyTaskNoLock(FiberAndThread& ft, int thread);
+    // 从某个优先级的注入队列取一个任务, 工作窃取模式下普通任务顺带搬一批到本地队列
+    bool takeInjectTask(FiberAndThread& ft, Priority prio, WorkerQueue* local);
+    // 从某个优先级的公共任务中取一个任务, 普通优先级先取本地和指定了线程的任务
+    bool takeLevelTask(FiberAndThread& ft, Priority prio, WorkerQueue* local);
+    // 按优先级取下一个任务, 取到时已经计为活跃线程
+    bool nextTask(FiberAndThread& ft, WorkerQueue* local);
     // 针对添加的任务是协程或者函数自动分配
     // 基于不同的函数签名
+    // 只能移动, 入队和出队都不会复制函数
     struct FiberAndThread {
         Fiber::ptr fiber;
-        std::function<void()> cb;
+        Task cb;
         int thread;
+        // 协程以 READY 切出后按原优先级重新调度
+        Priority prio = PRIORITY_NORMAL;
         // 协程
         FiberAndThread(Fiber::ptr f, int thr) 
-            :fiber(f), thread(thr) { 
+            :fiber(std::move(f)), thread(thr) { 
         }
         // 协程指针
         FiberAndThread(Fiber::ptr* f, int thr) 
             :thread(thr) {
             fiber.swap(*f);
         }
-        // 函数
-        FiberAndThread(std::function<void()> f, int thr)
-            :cb(f), thread(thr) {
-        }
-        // 函数指针
+        // 函数指针, 取走函数并置空
         FiberAndThread(std::function<void()>* f, int thr)
-            :thread(thr) {
-            cb.swap(*f);
+            :cb(std::move(*f)), thread(thr) {
+            *f = nullptr;
+        }
+        FiberAndThread(Task* f, int thr)
+            :cb(std::move(*f)), thread(thr) {
+        }
+        // 函数, lambda 等可调用对象
+        template<class Cb>
+        FiberAndThread(Cb&& f, int thr)
+            :cb(std::forward<Cb>(f)), thread(thr) {
         }
 
         FiberAndThread()
@@ -123,19 +350,115 @@ private:
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            prio = PRIORITY_NORMAL;
         }
     };
+    // 工作窃取模式下每个工作线程私有的任务队列
+    // 本线程从队头取任务, 其他线程从队尾窃取
+    // 也用作指定给某个工作线程的任务的专属队列
+    struct WorkerQueue {
+        MutexType mutex;
+        TaskList fibers;
+        // 出队后留下的空节点
+        TaskList spare;
+        // 专属队列所属的线程 id, 线程开始调度时记录, 退出后为 -1
+        std::atomic<int> thread = {-1};
+    };
+    // 返回当前线程在此调度器中的本地队列, 非工作窃取模式或非工作线程返回 nullptr
+    WorkerQueue* getLocalQueue();
+    // 返回线程 id 对应的专属队列, 线程不是正在调度的工作线程时返回 nullptr
+    WorkerQueue* getPinnedQueue(int thread);
+    // 工作线程私有的就绪列表, 只由所属线程读写, 不加锁
+    struct ReadyList {
+        std::vector<FiberAndThread> tasks;
+        // 下一个要取的位置, 取完后清空列表, 保留容量
+        size_t head = 0;
+    };
+    // 返回当前线程在此调度器中的就绪列表, 非工作线程返回 nullptr
+    ReadyList* getReadyList();
+    // 从当前线程的就绪列表取一个任务, 取到时已经计为活跃线程
+    bool takeReadyTask(FiberAndThread& ft);
+    // 从任务列表中取出一个当前线程可执行的任务, 调用方负责加锁
+    // 取出的节点放入 spare 供下次入队复用
+    bool takeTask(TaskList& fibers, TaskList& spare, FiberAndThread& ft, bool from_back = false);
+    // 把取空的节点移到 spare
+    void releaseTaskNode(TaskList& fibers, TaskList& spare, TaskList::iterator it);
+    // 从其他工作线程的队列尾部窃取任务, 多窃取的部分放入本地队列
+    // 弹性线程没有本地队列, 只窃取一个
+    bool stealTask(FiberAndThread& ft, WorkerQueue* local);
 private:
     // 锁
     MutexType m_mutex;
     // 进程池
     std::vector<Thread::ptr> m_threads;
-    // 任务池
-    std::list<FiberAndThread> m_fibers;
+    // 指定了线程的任务, 目标线程还没有专属队列时按线程 id 分开存放
+    std::unordered_map<int, TaskList> m_threadFibers;
+    // 已经退出的弹性线程 id, 指定给它们的任务改为任意线程执行, 由 m_mutex 保护
+    std::unordered_set<int> m_exitedThreads;
+    // 每个工作线程的专属队列, 下标为工作线程序号, 在 start 中创建
+    std::vector<WorkerQueue*> m_pinnedQueues;
+    // 每个工作线程的就绪列表, 下标为工作线程序号, 在 start 中创建
+    std::vector<ReadyList*> m_readyLists;
+    // 公共队列和 m_threadFibers 出队后留下的空节点, 由 m_mutex 保护
+    TaskList m_spareTasks;
+    // 同一优先级的任意线程均可执行的任务
+    struct LevelQueue {
+        LevelQueue(size_t capacity)
+            :inject(capacity) {
+        }
+        // 先放入无锁的注入队列
+        MPMCQueue<FiberAndThread> inject;
+        // 注入队列满了或者暂时不能执行的任务, 由 m_mutex 保护
+        TaskList fibers;
+        // 两者的任务数
+        std::atomic<size_t> count = {0};
+    };
+    LevelQueue* m_levels[PRIORITY_COUNT];
+    std::atomic<uint64_t> m_injectOverflows = {0};
+    // 低优先级任务被跳过的次数上限
+    uint32_t m_fairInterval = 0;
+    // 弹性模式下最多的线程数, 不大于 m_threadCount 时不开启
+    size_t m_maxThreads = 0;
+    // 所有线程忙碌多久之后增加线程, 毫秒
+    uint64_t m_busyThreshold = 0;
+    // 弹性线程空闲多久之后退出, 毫秒
+    uint64_t m_idleTimeout = 0;
+    // 弹性线程, 下标为槽位, 空槽位为 nullptr, 由 m_mutex 保护
+    std::vector<Thread::ptr> m_elasticThreads;
+    // 已经退出 run, 等待监控线程 join 的槽位
+    std::vector<bool> m_elasticExited;
+    // 运行中的弹性线程数
+    std::atomic<size_t> m_elasticCount = {0};
+    std::atomic<uint64_t> m_threadsAdded = {0};
+    std::atomic<uint64_t> m_threadsRetired = {0};
+    // 监控线程
+    Thread::ptr m_monitor;
+    // 工作线程绑定的 CPU
+    std::vector<int> m_cpus;
+    // 所有优先级公共队列中的任务总数
+    std::atomic<size_t> m_anyTaskCount = {0};
+    // 指定了线程的任务总数
+    std::atomic<size_t> m_threadTaskCount = {0};
+    // 其中放在 m_threadFibers 中的任务数
+    std::atomic<size_t> m_threadMapTaskCount = {0};
     // 根协程
     Fiber::ptr m_rootFiber;
     // 调度器名称
     std::string m_name;
+    // 是否为工作窃取模式
+    bool m_workStealing = false;
+    // 调度器创建的协程使用的栈大小, 0 表示默认大小
+    uint32_t m_stackSize = 0;
+    // 调度器创建的协程是否运行在共享栈上
+    bool m_sharedStack = false;
+    // 每个线程协程池的上限
+    uint32_t m_fiberPoolSize = 0;
+    std::atomic<uint64_t> m_fiberReuseCount = {0};
+    std::atomic<uint64_t> m_fiberCreateCount = {0};
+    // 每个工作线程的本地队列, 下标为工作线程序号, use_caller 时最后一个属于根线程
+    std::vector<WorkerQueue*> m_workerQueues;
+    // 所有本地队列中的任务总数
+    std::atomic<size_t> m_localTaskCount = {0};
 protected:
     // 线程id池
     std::vector<int> m_threadIds;
@@ -145,6 +468,10 @@ protected:
     std::atomic<size_t> m_activeThreadCount = {0};
     // 空闲的线程数
     std::atomic<size_t> m_idleThreadCount = {0};
+    // 被唤醒的次数
+    std::atomic<uint64_t> m_wakeupCount = {0};
+    // 被唤醒后没有取到任务的次数
+    std::atomic<uint64_t> m_spuriousWakeups = {0};
     // 是否需要停止
     bool m_stopping = true;
     // 是否需要自动停止
@@ -112,6 +112,17 @@ bool Socket::setOption(int level, int option, const void* result, size_t len) {
     return true;
 }
 
+bool Socket::setReusePort() {
+    if (!isVaild()) {
+        newSock();
+        if (SYLAR_UNLICKLY(!isVaild())) {
+            return false;
+        }
+    }
+    int val = 1;
+    return setOption(SOL_SOCKET, SO_REUSEPORT, val);
+}
+
 // 创建新的sock与客户端连接
 Socket::ptr Socket::accept() {
     // 绑定了协议类型等, 但还没连接
@@ -363,7 +374,7 @@ Address::ptr Socket::getLocalAddress() {
             break;
     }
     socklen_t addrlen = result->getAddrLen();
-    if (getpeername(m_sock, result->getAddr(), &addrlen)) {
+    if (getsockname(m_sock, result->getAddr(), &addrlen)) {
         std::cout << "getsockname error sock=" << m_sock 
                 << " errno=" << errno << " errstr=" << strerror(errno) << std::endl;
         return Address::ptr(new UnknownAddress(m_family));
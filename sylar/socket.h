@@ -62,6 +62,9 @@ public:
         return setOption(level, option, &value, sizeof(T));
     }
 
+    // 开启 SO_REUSEPORT, 多个 sock 可以绑定同一个地址, 由内核分配连接, 需要在 bind 之前调用
+    bool setReusePort();
+
     virtual Socket::ptr accept();
 
     virtual bool init(int sock);
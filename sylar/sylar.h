@@ -7,6 +7,8 @@
 #include "thread.h"
 #include "util.h"
 #include "fiber.h"
+#include "fiber_sync.h"
+#include "channel.h"
 #include "scheduler.h"
 #include "iomanager.h"
 
@@ -0,0 +1,174 @@
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sylar {
+
+// 只能移动的可调用对象, 用于调度器的任务
+// 和 std::function 相比内联缓冲区更大, 捕获一个 shared_ptr 加几个整数的 lambda 不需要分配内存
+// 超过缓冲区大小或者移动可能抛异常的对象才放到堆上
+class Task {
+public:
+    // 内联缓冲区大小
+    static const size_t kInlineSize = 64;
+
+    Task() noexcept {}
+    Task(std::nullptr_t) noexcept {}
+
+    template<class F, class = typename std::enable_if<
+                !std::is_same<typename std::decay<F>::type, Task>::value
+                && !std::is_same<typename std::decay<F>::type, std::nullptr_t>::value>::type>
+    Task(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        // 空的 std::function 或函数指针视为空任务
+        if (IsNull(f)) {
+            return ;
+        }
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool, IsInline<Fn>()>());
+        m_ops = &OpsFor<Fn>::s_ops;
+    }
+
+    Task(Task&& o) noexcept {
+        moveFrom(o);
+    }
+
+    Task& operator=(Task&& o) noexcept {
+        if (this != &o) {
+            reset();
+            moveFrom(o);
+        }
+        return *this;
+    }
+
+    Task& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        reset();
+    }
+
+    // 执行任务
+    void operator()() {
+        m_ops->invoke(m_buf);
+    }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+
+    // 可调用对象是否放在内联缓冲区中
+    bool isInline() const { return m_ops && m_ops->is_inline; }
+
+    // 析构可调用对象, 置为空任务
+    void reset() noexcept {
+        if (m_ops) {
+            m_ops->destroy(m_buf);
+            m_ops = nullptr;
+        }
+    }
+
+    void swap(Task& o) noexcept {
+        Task tmp(std::move(o));
+        o = std::move(*this);
+        *this = std::move(tmp);
+    }
+private:
+    // 对不同类型的可调用对象的操作
+    struct Ops {
+        void (*invoke)(void* buf);
+        // 从 src 移动构造到 dst, 并析构 src
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* buf);
+        bool is_inline;
+    };
+
+    template<class Fn>
+    static constexpr bool IsInline() {
+        return sizeof(Fn) <= kInlineSize
+            && alignof(Fn) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template<class Fn, bool = IsInline<Fn>()>
+    struct OpsFor {
+        static void Invoke(void* buf) {
+            (*reinterpret_cast<Fn*>(buf))();
+        }
+        static void Move(void* dst, void* src) {
+            Fn* f = reinterpret_cast<Fn*>(src);
+            new (dst) Fn(std::move(*f));
+            f->~Fn();
+        }
+        static void Destroy(void* buf) {
+            reinterpret_cast<Fn*>(buf)->~Fn();
+        }
+        static const Ops s_ops;
+    };
+
+    // 放在堆上的可调用对象, 缓冲区中只保存指针
+    template<class Fn>
+    struct OpsFor<Fn, false> {
+        static void Invoke(void* buf) {
+            (**reinterpret_cast<Fn**>(buf))();
+        }
+        static void Move(void* dst, void* src) {
+            *reinterpret_cast<Fn**>(dst) = *reinterpret_cast<Fn**>(src);
+        }
+        static void Destroy(void* buf) {
+            delete *reinterpret_cast<Fn**>(buf);
+        }
+        static const Ops s_ops;
+    };
+
+    template<class T>
+    static bool IsNull(const T&) { return false; }
+    template<class T>
+    static bool IsNull(T* p) { return p == nullptr; }
+    template<class R, class... Args>
+    static bool IsNull(const std::function<R(Args...)>& f) { return !f; }
+
+    template<class Fn, class F>
+    void construct(F&& f, std::true_type) {
+        new (m_buf) Fn(std::forward<F>(f));
+    }
+
+    template<class Fn, class F>
+    void construct(F&& f, std::false_type) {
+        *reinterpret_cast<Fn**>(m_buf) = new Fn(std::forward<F>(f));
+    }
+
+    void moveFrom(Task& o) noexcept {
+        if (o.m_ops) {
+            o.m_ops->move(m_buf, o.m_buf);
+            m_ops = o.m_ops;
+            o.m_ops = nullptr;
+        }
+    }
+private:
+    alignas(std::max_align_t) unsigned char m_buf[kInlineSize];
+    const Ops* m_ops = nullptr;
+};
+
+template<class Fn, bool B>
+const Task::Ops Task::OpsFor<Fn, B>::s_ops = {
+    &Task::OpsFor<Fn, B>::Invoke, &Task::OpsFor<Fn, B>::Move
+    , &Task::OpsFor<Fn, B>::Destroy, true
+};
+
+template<class Fn>
+const Task::Ops Task::OpsFor<Fn, false>::s_ops = {
+    &Task::OpsFor<Fn, false>::Invoke, &Task::OpsFor<Fn, false>::Move
+    , &Task::OpsFor<Fn, false>::Destroy, false
+};
+
+}
+
+#endif
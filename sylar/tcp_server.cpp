@@ -40,26 +40,41 @@ bool TcpServer::bind(const std::vector<Address::ptr>& addrs
                         ,std::vector<Address::ptr>& fails
                         ,bool ssl) {
     m_ssl = ssl;
+    // 分片模式下每个地址给每个 accept 线程一个 SO_REUSEPORT 的 sock
+    m_shardCount = m_acceptWorker->getShardCount();
     // 遍历 addrs, 创建 sock 并绑定和监听
     for(auto& addr : addrs) {
-        Socket::ptr sock = ssl ? SSLSocket::CreateTCP(addr) : Socket::CreateTCP(addr);
-        if(!sock->bind(addr)) {
-            std::cout << "bind fail errno="
-                << errno << " errstr=" << strerror(errno)
-                << " addr=[" << addr->toString() << "]"
-                << std::endl;
-            fails.push_back(addr);
-            continue;
-        }
-        if(!sock->listen()) {
-            std::cout << "listen fail errno="
-                << errno << " errstr=" << strerror(errno)
-                << " addr=[" << addr->toString() << "]"
-                << std::endl;
-            fails.push_back(addr);
-            continue;
+        Address::ptr bind_addr = addr;
+        for(size_t i = 0; i < m_shardCount; ++i) {
+            Socket::ptr sock = ssl ? SSLSocket::CreateTCP(addr) : Socket::CreateTCP(addr);
+            if(m_shardCount > 1 && !sock->setReusePort()) {
+                std::cout << "setReusePort fail errno="
+                    << errno << " errstr=" << strerror(errno)
+                    << " addr=[" << addr->toString() << "]"
+                    << std::endl;
+                fails.push_back(addr);
+                break;
+            }
+            if(!sock->bind(bind_addr)) {
+                std::cout << "bind fail errno="
+                    << errno << " errstr=" << strerror(errno)
+                    << " addr=[" << addr->toString() << "]"
+                    << std::endl;
+                fails.push_back(addr);
+                break;
+            }
+            if(!sock->listen()) {
+                std::cout << "listen fail errno="
+                    << errno << " errstr=" << strerror(errno)
+                    << " addr=[" << addr->toString() << "]"
+                    << std::endl;
+                fails.push_back(addr);
+                break;
+            }
+            m_socks.push_back(sock);
+            // 端口为 0 时其他 sock 绑定到第一个 sock 实际分配的端口
+            bind_addr = sock->getLocalAddress();
         }
-        m_socks.push_back(sock);
     }
 
     if(!fails.empty()) {
@@ -85,8 +100,14 @@ void TcpServer::startAccept(Socket::ptr sock) {
         Socket::ptr client = sock->accept();
         if(client) {
             client->setRecvTimeout(m_recvTimeout);
-            m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
-                        shared_from_this(), client));
+            if(m_shardCount > 1 && m_ioWorker == m_acceptWorker) {
+                // 分片模式下连接留在 accept 它的线程上处理, 之后的读写也注册在这个线程的 epoll 中
+                m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
+                            shared_from_this(), client), Scheduler::THIS_THREAD);
+            } else {
+                m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
+                            shared_from_this(), client));
+            }
         } else {
             std::cout << "accept errno=" << errno
                 << " errstr=" << strerror(errno)
@@ -101,9 +122,12 @@ bool TcpServer::start() {
         return true;
     }
     m_isStop = false;
-    for(auto& sock : m_socks) {
+    for(size_t i = 0; i < m_socks.size(); ++i) {
+        // 分片模式下同一地址的第 i 个 sock 固定在第 i 个线程上 accept
+        int thread = m_shardCount > 1 
+                    ? m_acceptWorker->getWorkerThreadId(i % m_shardCount) : -1;
         m_acceptWorker->schedule(std::bind(&TcpServer::startAccept,
-                    shared_from_this(), sock));
+                    shared_from_this(), m_socks[i]), thread);
     }
     return true;
 }
@@ -119,6 +119,8 @@ public:
 
     
     bool loadCertificates(const std::string& cert_file, const std::string& key_file);
+    // accept_worker 为分片模式时每个线程在自己的 sock 上 accept,
+    // io_worker 和 accept_worker 相同时连接在 accept 它的线程上处理
     virtual bool start();
     virtual void stop();
     uint64_t getRecvTimeout() const { return m_recvTimeout;}
@@ -148,6 +150,8 @@ protected:
     bool m_isStop;
 
     bool m_ssl = false;
+    // 每个地址的 sock 个数, accept_worker 为分片模式时等于它的线程数
+    size_t m_shardCount = 1;
 
     TcpServerConf::ptr m_conf;
 };
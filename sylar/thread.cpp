@@ -26,6 +26,26 @@ namespace sylar {
         t_thread_name = name;
     }
 
+    bool Thread::SetAffinity(const std::vector<int>& cpus) {
+        if (cpus.empty()) {
+            return true;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rt) {
+            std::cout << "pthread_setaffinity_np fail, rt=" << rt 
+                << " name=" << t_thread_name << std::endl;
+            return false;
+        }
+        return true;
+    }
+
     Thread::Thread(std::function<void()> cb, const std::string& name) 
         :m_cb(cb)
         ,m_name(name) {
@@ -6,6 +6,7 @@
 #include "noncopyable.h"
 
 #include <string>
+#include <vector>
 
 namespace sylar {
 
@@ -29,6 +30,8 @@ class Thread : public Noncopyable {
         static Thread* GetThis();
         static const std::string& GetName(); // return the running thread name
         static void SetName(const std::string& name);   // set the running name
+        // 把调用线程绑定到 cpus 中的 CPU 上, cpus 为空时不做修改
+        static bool SetAffinity(const std::vector<int>& cpus);
     private:
         static void* run(void* arg);
     private:
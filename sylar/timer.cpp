@@ -1,8 +1,200 @@
 #include "timer.h"
 #include "util.h"
 #include "log.h"
+#include "config.h"
+
+#include <algorithm>
 
 namespace sylar {
+// 定时器的存储方式, set 或 wheel
+static ConfigVar<std::string>::ptr g_timer_type =
+    Config::Lookup("timer.type", std::string("set")
+            , "timer storage of TimerManager, set or wheel");
+
+// 当前线程绑定的 TimerManager 和其中的分片
+static thread_local TimerManager* t_timer_manager = nullptr;
+static thread_local int t_timer_shard = -1;
+
+TimingWheel::TimingWheel(uint64_t now_ms)
+    :m_now(now_ms) {
+}
+
+TimingWheel::~TimingWheel() {
+    // 释放定时器对自身的引用
+    std::vector<Timer::ptr> timers;
+    clear(m_now, timers);
+}
+
+void TimingWheel::add(const Timer::ptr& timer) {
+    timer->m_wheelSelf = timer;
+    // 当前这一毫秒已经处理过, 最早放到下一毫秒
+    insert(timer.get(), m_now + 1);
+    ++m_size;
+}
+
+void TimingWheel::insert(Timer* timer, uint64_t min_expire) {
+    uint64_t expire = std::max(timer->m_next, min_expire);
+    uint64_t delta = expire - m_now;
+    int level = 0;
+    Timer** slot = nullptr;
+    if (delta < ROOT_SIZE) {
+        slot = &m_root[expire & (ROOT_SIZE - 1)];
+    } else {
+        // 超出最高层范围的先放在最高层的最远处, 降级时按真实的到期时间重新放
+        static const uint64_t s_max_delta = 1ull << (ROOT_BITS + LEVEL_BITS * (LEVELS - 1));
+        if (delta >= s_max_delta) {
+            delta = s_max_delta - 1;
+            expire = m_now + delta;
+        }
+        level = 1;
+        while (delta >= 1ull << (ROOT_BITS + LEVEL_BITS * level)) {
+            ++level;
+        }
+        int shift = ROOT_BITS + LEVEL_BITS * (level - 1);
+        slot = &m_levels[level - 1][(expire >> shift) & (LEVEL_SIZE - 1)];
+    }
+    timer->m_wheelLevel = level;
+    timer->m_wheelSlot = slot;
+    timer->m_wheelPrev = nullptr;
+    timer->m_wheelNext = *slot;
+    if (*slot) {
+        (*slot)->m_wheelPrev = timer;
+    }
+    *slot = timer;
+    ++m_counts[level];
+}
+
+void TimingWheel::remove(Timer* timer) {
+    if (!timer->m_wheelSlot) {
+        return ;
+    }
+    if (timer->m_wheelPrev) {
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+    } else {
+        *timer->m_wheelSlot = timer->m_wheelNext;
+    }
+    if (timer->m_wheelNext) {
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    }
+    --m_counts[timer->m_wheelLevel];
+    --m_size;
+    timer->m_wheelPrev = nullptr;
+    timer->m_wheelNext = nullptr;
+    timer->m_wheelSlot = nullptr;
+    // 最后释放, 调用方持有定时器的引用
+    timer->m_wheelSelf.reset();
+}
+
+Timer* TimingWheel::takeSlot(int level, size_t index) {
+    Timer** slot = level ? &m_levels[level - 1][index] : &m_root[index];
+    Timer* head = *slot;
+    *slot = nullptr;
+    return head;
+}
+
+void TimingWheel::cascade(int level, size_t index) {
+    Timer* timer = takeSlot(level, index);
+    while (timer) {
+        Timer* next = timer->m_wheelNext;
+        --m_counts[level];
+        // 当前这一毫秒还没处理, 到期的放进当前槽位
+        insert(timer, m_now);
+        timer = next;
+    }
+}
+
+uint64_t TimingWheel::getNextExpire() const {
+    if (!m_size) {
+        return ~0ull;
+    }
+    uint64_t next = ~0ull;
+    if (m_counts[0]) {
+        for (uint64_t t = m_now + 1; t <= m_now + ROOT_SIZE; ++t) {
+            if (m_root[t & (ROOT_SIZE - 1)]) {
+                next = t;
+                break;
+            }
+        }
+    }
+    // 高层的定时器在所在槽位降级时才能确定到期时间, 返回降级的时间
+    for (int level = 1; level < LEVELS; ++level) {
+        if (!m_counts[level]) {
+            continue;
+        }
+        int shift = ROOT_BITS + LEVEL_BITS * (level - 1);
+        uint64_t base = m_now >> shift;
+        for (uint64_t k = 1; k <= LEVEL_SIZE; ++k) {
+            if (m_levels[level - 1][(base + k) & (LEVEL_SIZE - 1)]) {
+                next = std::min(next, (base + k) << shift);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void TimingWheel::advance(uint64_t now_ms, std::vector<Timer::ptr>& expired) {
+    while (m_now < now_ms) {
+        if (!m_size) {
+            m_now = now_ms;
+            break;
+        }
+        // 第 0 层为空时直接跳到下一次降级之前
+        if (!m_counts[0]) {
+            uint64_t skip = m_now | (ROOT_SIZE - 1);
+            if (skip >= now_ms) {
+                m_now = now_ms;
+                break;
+            }
+            m_now = skip;
+        }
+        ++m_now;
+        size_t index = m_now & (ROOT_SIZE - 1);
+        // 第 0 层转完一圈, 逐层把下一格降下来
+        if (index == 0) {
+            for (int level = 1; level < LEVELS; ++level) {
+                int shift = ROOT_BITS + LEVEL_BITS * (level - 1);
+                size_t level_index = (m_now >> shift) & (LEVEL_SIZE - 1);
+                cascade(level, level_index);
+                if (level_index) {
+                    break;
+                }
+            }
+        }
+        Timer* timer = takeSlot(0, index);
+        while (timer) {
+            Timer* next = timer->m_wheelNext;
+            --m_counts[0];
+            --m_size;
+            timer->m_wheelPrev = nullptr;
+            timer->m_wheelNext = nullptr;
+            timer->m_wheelSlot = nullptr;
+            expired.push_back(std::move(timer->m_wheelSelf));
+            timer = next;
+        }
+    }
+}
+
+void TimingWheel::clear(uint64_t now_ms, std::vector<Timer::ptr>& timers) {
+    for (int level = 0; level < LEVELS; ++level) {
+        size_t count = level ? LEVEL_SIZE : ROOT_SIZE;
+        for (size_t i = 0; i < count; ++i) {
+            Timer* timer = takeSlot(level, i);
+            while (timer) {
+                Timer* next = timer->m_wheelNext;
+                timer->m_wheelPrev = nullptr;
+                timer->m_wheelNext = nullptr;
+                timer->m_wheelSlot = nullptr;
+                timers.push_back(std::move(timer->m_wheelSelf));
+                timer = next;
+            }
+        }
+        m_counts[level] = 0;
+    }
+    m_size = 0;
+    m_now = now_ms;
+}
+
 // 要满足 右 > 左
 // 用于 set 中定时器的比较
 bool Timer::Comparator::operator()(const Timer::ptr& lhs
@@ -26,14 +218,15 @@ bool Timer::Comparator::operator()(const Timer::ptr& lhs
 }
 
 // 构造
-// 是否循环, 周期, 执行的函数, 是否循环, 管理器
+// 是否循环, 周期, 执行的函数, 是否循环, 管理器, 余量
 Timer::Timer(uint64_t ms, std::function<void()> cb,
-                bool recurring, TimerManager* manager)
+                bool recurring, TimerManager* manager, uint64_t slack)
             :m_recurring(recurring)
+            ,m_slack(slack)
             ,m_ms(ms)
             ,m_cb(cb)
             ,m_manager(manager) {
-    m_next = sylar::GetCurrentMS() + m_ms;
+    setNext(sylar::GetCoarseMS() + m_ms);
 }
 
 Timer::Timer(uint64_t next)
@@ -41,34 +234,37 @@ Timer::Timer(uint64_t next)
 
 }
 
+void Timer::setNext(uint64_t next) {
+    // 对齐之后, 余量相同且到期时间落在同一个余量区间的定时器在同一时刻到期
+    // 时间轮中在同一个槽位, 一次唤醒一起触发
+    if (m_slack > 1) {
+        next = (next + m_slack - 1) / m_slack * m_slack;
+    }
+    m_next = next;
+}
+
+void Timer::update(uint64_t ms, uint64_t start) {
+    if (start == ~0ull) {
+        // 初次设置定时器时的时间, 有余量时和原来的起点最多差一个余量
+        start = m_next - m_ms;
+    }
+    // 更新周期
+    if (ms != ~0ull) {
+        m_ms = ms;
+    }
+    // 初次时间的基础上更新下次执行时间
+    setNext(start + m_ms);
+}
+
 // 取消定时器
-// 在 set 中 erase
+// 由所属线程在 set 或时间轮中移除, 其他线程取消时发消息给所属线程
 bool Timer::cancel() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (m_cb) {
-        m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
-        return true;
-    }
-    return false;
+    return m_manager->cancelTimer(this);
 }
 
 // 刷新定时器的时间
 bool Timer::refresh() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (!m_cb) {
-        return false;
-    }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if (it == m_manager->m_timers.end()) {
-        return false;
-    }
-    // 先清除再插入是为了保证时间的有序性
-    m_manager->m_timers.erase(it);
-    m_next = sylar::GetCurrentMS() + m_ms;
-    m_manager->m_timers.insert(shared_from_this());
-    return true;
+    return m_manager->requeueTimer(this, ~0ull, true);
 }
 
 // 指定时间和是否从现在开始的刷新
@@ -76,45 +272,184 @@ bool Timer::reset(uint64_t ms, bool from_now) {
     if (ms == m_ms && !from_now)  {
         return true;
     }
-    // 上写锁修改
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (!m_cb) {
-        return false;
+    return m_manager->requeueTimer(this, ms, from_now);
+}
+
+TimerManager::Shard::Shard(Type type, uint64_t now_ms) {
+    if (type == WHEEL) {
+        wheel = new TimingWheel(now_ms);
+    }
+}
+
+TimerManager::Shard::~Shard() {
+    // 释放在 inbox 中时对自身的引用
+    Timer* timer = inbox.exchange(nullptr);
+    while (timer) {
+        Timer* next = timer->m_inboxNext;
+        Timer::ptr self = std::move(timer->m_inboxSelf);
+        timer = next;
+    }
+    if (wheel) {
+        delete wheel;
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if (it == m_manager->m_timers.end()) {
+}
+
+bool TimerManager::Shard::insert(const Timer::ptr& timer) {
+    ++size;
+    if (wheel) {
+        bool was_empty = wheel->empty();
+        wheel->add(timer);
+        // 时间轮没有全局的顺序, 和空闲线程将要醒来的时间比较
+        return was_empty || timer->m_next < wakeTime;
+    }
+    // 和原来最早的定时器同时到期时, 空闲线程醒来会一起触发, 不算插到首部
+    // 有余量的定时器已经对齐, 不早于原来最早的定时器时推迟不超过自己的余量
+    auto it = timers.insert(timer).first;
+    if (it != timers.begin()) {
         return false;
     }
-    // 先 erase 再 insert 是为了保证 set 的有序性
-    m_manager->m_timers.erase(it);
-    uint64_t start = 0;
-    if (from_now) {
-        start = sylar::GetCurrentMS();
+    ++it;
+    return it == timers.end() || timer->m_next < (*it)->m_next;
+}
+
+bool TimerManager::Shard::remove(Timer* timer) {
+    if (wheel) {
+        if (!timer->m_wheelSlot) {
+            return false;
+        }
+        wheel->remove(timer);
     } else {
-        // 初次设置定时器时的时间
-        start = m_next - m_ms;
+        auto it = timers.find(timer->shared_from_this());
+        if (it == timers.end()) {
+            return false;
+        }
+        timers.erase(it);
     }
-    // 更新周期
-    m_ms = ms;
-    // 初次时间的基础上更新下次执行时间
-    m_next = start + m_ms;
-    // 注意这里传的锁是引用
-    m_manager->addTimer(shared_from_this(), lock);
+    --size;
     return true;
 }
 
-TimerManager::TimerManager() {
-    m_previousTime = sylar::GetCurrentMS();
+uint64_t TimerManager::Shard::getNext() const {
+    if (wheel) {
+        return wheel->getNextExpire();
+    }
+    return timers.empty() ? ~0ull : (*timers.begin())->m_next;
+}
+
+void TimerManager::Shard::takeExpired(uint64_t now_ms
+                                    , std::vector<Timer::ptr>& expired) {
+    size_t count = expired.size();
+    if (wheel) {
+        // 时间轮推进到当前时间, 取出到期的定时器
+        wheel->advance(now_ms, expired);
+    } else {
+        // 新建一个当前时间的 timer
+        Timer::ptr now_timer(new Timer(now_ms));
+        // 获取到超过当前时间的 timer 的迭代器(set的有序性)
+        auto it = timers.lower_bound(now_timer);
+        while (it != timers.end() && (*it)->m_next == now_ms) {
+            ++it;
+        }
+        // 插入所有已超时的定时器
+        expired.insert(expired.end(), timers.begin(), it);
+        // 删除已超时的定时器
+        timers.erase(timers.begin(), it);
+    }
+    size -= expired.size() - count;
+}
+
+void TimerManager::Shard::takeAll(std::vector<Timer::ptr>& all) {
+    if (wheel) {
+        wheel->clear(sylar::GetCoarseMS(), all);
+    } else {
+        all.insert(all.end(), timers.begin(), timers.end());
+        timers.clear();
+    }
+    size = 0;
+}
+
+TimerManager::TimerManager()
+    :TimerManager(g_timer_type->getValue() == "wheel" ? WHEEL : SET) {
+}
+
+TimerManager::TimerManager(Type type)
+    :m_type(type) {
+    m_shared = new Shard(m_type, sylar::GetCoarseMS());
 }
 
 TimerManager::~TimerManager() {
+    for (auto shard : m_shards) {
+        delete shard;
+    }
+    delete m_shared;
+}
+
+void TimerManager::initTimerShards(size_t count) {
+    uint64_t now_ms = sylar::GetCoarseMS();
+    while (m_shards.size() < count) {
+        m_shards.push_back(new Shard(m_type, now_ms));
+    }
+}
+
+void TimerManager::bindTimerShard(int shard) {
+    if (shard < 0 || shard >= (int)m_shards.size()) {
+        return ;
+    }
+    t_timer_manager = this;
+    t_timer_shard = shard;
+}
+
+void TimerManager::unbindTimerShard() {
+    int shard = getCurrentShard();
+    if (shard < 0) {
+        return ;
+    }
+    drainInbox(shard);
+    std::vector<Timer::ptr> timers;
+    m_shards[shard]->takeAll(timers);
+    t_timer_manager = nullptr;
+    t_timer_shard = -1;
+    if (timers.empty()) {
+        return ;
+    }
+
+    // 线程退出后没人处理这个分片, 还没到期的定时器交给所有线程
+    RWMutexType::WriteLock lock(m_mutex);
+    bool at_front = false;
+    for (auto& timer : timers) {
+        timer->m_shard = -1;
+        if (timer->m_state == Timer::ACTIVE) {
+            at_front = m_shared->insert(timer) || at_front;
+        } else {
+            timer->m_cb = nullptr;
+        }
+    }
+    at_front = at_front && !m_tickled;
+    if (at_front) {
+        m_tickled = true;
+    }
+    lock.unlock();
+    if (at_front) {
+        onTimerInsertedAtFront();
+    }
+}
 
+int TimerManager::getCurrentShard() const {
+    return t_timer_manager == this ? t_timer_shard : -1;
 }
 
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb
-                        , bool recurring) {
+                        , bool recurring, uint64_t slack_ms) {
     // 创建 timer 
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
+    Timer::ptr timer(new Timer(ms, cb, recurring, this, slack_ms));
+    ++m_timerCount;
+    int shard = getCurrentShard();
+    if (shard >= 0) {
+        // 放入当前线程的分片, 本线程空闲时会重新计算超时, 不需要唤醒
+        timer->m_shard = shard;
+        m_shards[shard]->insert(timer);
+        return timer;
+    }
     RWMutexType::WriteLock lock(m_mutex);
     addTimer(timer, lock);
     return timer;
@@ -130,82 +465,246 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
 
 Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
                                 , std::weak_ptr<void> weak_cond
-                                , bool recurring) {
+                                , bool recurring, uint64_t slack_ms) {
     // OnTimer的第一次参数为weak_cond, 第二个为cb, 返回一个新的可调用对象
     // 到时间后若满足条件(可获取到 weak_cond)则执行 cb
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring, slack_ms);
+}
+
+void TimerManager::rearmTimer(Timer::ptr& timer, uint64_t ms
+                        , std::function<void()> cb, uint64_t slack_ms) {
+    int shard = getCurrentShard();
+    // 其他线程发来的操作只由所属线程处理, 当前线程的分片中 m_ops 为 0 时
+    // 定时器已经不在存储和 inbox 中, 可以直接重新放入
+    if (!timer || shard < 0 || timer->m_shard != shard
+            || timer->m_state == Timer::ACTIVE || timer->m_ops) {
+        if (timer) {
+            timer->cancel();
+        }
+        timer = addTimer(ms, std::move(cb), false, slack_ms);
+        return ;
+    }
+    timer->m_recurring = false;
+    timer->m_slack = slack_ms;
+    timer->m_ms = ms;
+    timer->m_cb = std::move(cb);
+    timer->setNext(sylar::GetCoarseMS() + ms);
+    timer->m_state = Timer::ACTIVE;
+    ++m_timerCount;
+    m_shards[shard]->insert(timer);
 }
 
 // 获取最近要发生的定时器的触发时间
 uint64_t TimerManager::getNextTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
     m_tickled = false;
-    if (m_timers.empty()) {
+    uint64_t next = ~0ull;
+    int shard = getCurrentShard();
+    if (shard >= 0) {
+        // 其他线程可能把定时器提前了, 先处理 inbox
+        drainInbox(shard);
+        next = m_shards[shard]->getNext();
+    }
+    if (m_shared->size) {
+        RWMutexType::ReadLock lock(m_mutex);
+        uint64_t shared_next = m_shared->getNext();
+        m_shared->wakeTime = shared_next;
+        next = std::min(next, shared_next);
+    }
+    if (next == ~0ull) {
         return ~0ull;
     }
 
-    const Timer::ptr& next = *m_timers.begin();
-    uint64_t now_ms = sylar::GetCurrentMS();
+    uint64_t now_ms = sylar::GetCoarseMS();
     // 若已经超时, 返回 0
-    if (now_ms >= next->m_next) {
+    if (now_ms >= next) {
         return 0;
     } else {
         // 若还未发生, 返回最近的时间
-        return next->m_next - now_ms;
+        return next - now_ms;
     }
 }
 
 void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
-    uint64_t now_ms = sylar::GetCurrentMS();
-    std::vector<Timer::ptr> expired;
-    // 判断是否有定时器
-    // 没有直接返回
+    uint64_t now_ms = sylar::GetCoarseMS();
+    // 自己的分片不加锁
+    int shard = getCurrentShard();
+    if (shard >= 0) {
+        drainInbox(shard);
+        Shard* s = m_shards[shard];
+        if (s->size) {
+            expireShard(s, now_ms, cbs);
+        }
+    }
+    // 公共分片为空或没有到期的定时器时不加写锁
+    if (!m_shared->size) {
+        return ;
+    }
     {
         RWMutexType::ReadLock lock(m_mutex);
-        if (m_timers.empty()) {
+        if (m_shared->getNext() > now_ms) {
             return ;
         }
-        lock.unlock();
     }
     RWMutexType::WriteLock lock(m_mutex);
-    // 检测服务器时间是否被调后了
-    bool rollover = detectClockRollover(now_ms);
-    if (!rollover && ((*m_timers.begin())->m_next > now_ms)) {
-        return ;
-    }
+    expireShard(m_shared, now_ms, cbs);
+} 
 
-    // 新建一个当前时间的 timer
-    Timer::ptr now_timer(new Timer(now_ms));
-    // 获取到超过当前时间的 timer 的迭代器(set的有序性)
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    
-    while (it != m_timers.end() && (*it)->m_next == now_ms) {
-        ++it;
+void TimerManager::expireShard(Shard* s, uint64_t now_ms
+                            , std::vector<std::function<void()> >& cbs) {
+    if (s->getNext() > now_ms) {
+        return ;
     }
-    // 插入所有已超时的定时器
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    // 删除已超时的定时器
-    m_timers.erase(m_timers.begin(), it);
-    cbs.reserve(expired.size());
+    std::vector<Timer::ptr> expired;
+    s->takeExpired(now_ms, expired);
+    cbs.reserve(cbs.size() + expired.size());
 
     // 遍历超时的定时器
     for (auto& timer : expired) {
-        // 添加进函数列表
-        cbs.push_back(timer->m_cb);
+        if (timer->m_state != Timer::ACTIVE) {
+            // 已被其他线程取消, inbox 中的消息还没处理
+            timer->m_cb = nullptr;
+            continue;
+        }
         // 需要循环的插回
         if (timer->m_recurring) {
-            timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
-        } else {
-            timer->m_cb = nullptr;
+            cbs.push_back(timer->m_cb);
+            timer->setNext(now_ms + timer->m_ms);
+            s->insert(timer);
+            continue;
+        }
+        // 和其他线程的取消竞争, 只有一方生效
+        int expected = Timer::ACTIVE;
+        if (timer->m_state.compare_exchange_strong(expected, Timer::DONE)) {
+            --m_timerCount;
+            cbs.push_back(std::move(timer->m_cb));
         }
+        timer->m_cb = nullptr;
     }
-} 
+}
+
+bool TimerManager::cancelTimer(Timer* timer) {
+    int expected = Timer::ACTIVE;
+    int shard = timer->m_shard;
+    if (shard < 0) {
+        RWMutexType::WriteLock lock(m_mutex);
+        if (!timer->m_state.compare_exchange_strong(expected, Timer::CANCELLED)) {
+            return false;
+        }
+        --m_timerCount;
+        timer->m_cb = nullptr;
+        m_shared->remove(timer);
+        return true;
+    }
+    if (!timer->m_state.compare_exchange_strong(expected, Timer::CANCELLED)) {
+        return false;
+    }
+    --m_timerCount;
+    if (shard == getCurrentShard()) {
+        m_shards[shard]->remove(timer);
+        timer->m_cb = nullptr;
+    } else {
+        // 不会再触发, 由所属线程移除和释放回调, 不需要唤醒它
+        postTimerOp(timer, shard, Timer::OP_CANCEL);
+    }
+    return true;
+}
+
+bool TimerManager::requeueTimer(Timer* timer, uint64_t ms, bool from_now) {
+    uint64_t start = from_now ? sylar::GetCoarseMS() : ~0ull;
+    int shard = timer->m_shard;
+    if (shard < 0) {
+        RWMutexType::WriteLock lock(m_mutex);
+        if (timer->m_state != Timer::ACTIVE) {
+            return false;
+        }
+        Timer::ptr self = timer->shared_from_this();
+        // 先清除再插入是为了保证时间的有序性
+        if (!m_shared->remove(timer)) {
+            return false;
+        }
+        timer->update(ms, start);
+        // 注意这里传的锁是引用
+        addTimer(self, lock);
+        return true;
+    }
+    if (timer->m_state != Timer::ACTIVE) {
+        return false;
+    }
+    if (shard == getCurrentShard()) {
+        Shard* s = m_shards[shard];
+        Timer::ptr self = timer->shared_from_this();
+        if (!s->remove(timer)) {
+            return false;
+        }
+        timer->update(ms, start);
+        s->insert(self);
+        return true;
+    }
+    // 参数先写好再入队, 多次重设以最后一次为准
+    timer->m_reqMs = ms;
+    timer->m_reqStart = start;
+    postTimerOp(timer, shard, Timer::OP_REQUEUE);
+    // 可能比所属线程要等的时间早
+    onTimerShardChanged(shard);
+    return true;
+}
+
+void TimerManager::postTimerOp(Timer* timer, int shard, int op) {
+    if (timer->m_ops.fetch_or(op)) {
+        // 已经在 inbox 中, 所属线程处理时会看到新的操作
+        return ;
+    }
+    timer->m_inboxSelf = timer->shared_from_this();
+    Shard* s = m_shards[shard];
+    Timer* head = s->inbox.load(std::memory_order_relaxed);
+    do {
+        timer->m_inboxNext = head;
+    } while (!s->inbox.compare_exchange_weak(head, timer
+                , std::memory_order_release, std::memory_order_relaxed));
+}
+
+void TimerManager::drainInbox(int shard) {
+    Shard* s = m_shards[shard];
+    if (!s->inbox.load(std::memory_order_relaxed)) {
+        return ;
+    }
+    Timer* timer = s->inbox.exchange(nullptr, std::memory_order_acquire);
+    while (timer) {
+        Timer* next = timer->m_inboxNext;
+        // 先取走引用再清除操作, 清除之后其他线程可以把它重新放入 inbox
+        Timer::ptr self = std::move(timer->m_inboxSelf);
+        int ops = timer->m_ops.exchange(0);
+        int owner = timer->m_shard;
+        if (owner == shard) {
+            applyTimerOps(s, timer, ops);
+        } else if (owner < 0) {
+            // 发送之后所属线程退出, 定时器已经移到公共分片
+            RWMutexType::WriteLock lock(m_mutex);
+            applyTimerOps(m_shared, timer, ops);
+        }
+        timer = next;
+    }
+}
+
+void TimerManager::applyTimerOps(Shard* s, Timer* timer, int ops) {
+    if (timer->m_state == Timer::CANCELLED) {
+        s->remove(timer);
+        timer->m_cb = nullptr;
+        return ;
+    }
+    if ((ops & Timer::OP_REQUEUE) && timer->m_state == Timer::ACTIVE) {
+        Timer::ptr self = timer->shared_from_this();
+        // 先清除再插入是为了保证时间的有序性
+        if (s->remove(timer)) {
+            timer->update(timer->m_reqMs, timer->m_reqStart);
+            s->insert(self);
+        }
+    }
+}
 
 void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
-    auto it = m_timers.insert(val).first;
     // 插入头部且未被唤醒
-    bool at_front = (it == m_timers.begin()) && !m_tickled;
+    bool at_front = m_shared->insert(val) && !m_tickled;
     if (at_front)
         m_tickled = true;
     lock.unlock();
@@ -217,19 +716,8 @@ void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
     }
 }
 
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
-    bool rollover = false;
-    if (now_ms < m_previousTime &&
-            now_ms < (m_previousTime - 60 * 60 * 1000)) {
-        rollover = true;
-    }
-    m_previousTime = now_ms;
-    return rollover;
-}   
-
 bool TimerManager::hasTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
-    return !m_timers.empty();
+    return m_timerCount > 0;
 }
 
 }
\ No newline at end of file
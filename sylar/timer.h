@@ -3,13 +3,62 @@
 
 #include <memory>
 #include <set>
+#include <vector>
+#include <atomic>
 #include "thread.h"
+#include "noncopyable.h"
 
 namespace sylar {
 
-class TimerManager;    
+class Timer;
+class TimerManager;
+
+// 分层时间轮, 毫秒精度
+// 第一层 256 个槽位, 每个 1ms; 之后四层各 64 个槽位, 一个槽位等于下一层转一圈, 共约 49 天
+// 添加和删除都是 O(1), 高层的定时器在下一层转完一圈时降到下一层
+// 不加锁, 由 TimerManager 的锁保护
+class TimingWheel : Noncopyable {
+public:
+    TimingWheel(uint64_t now_ms);
+    ~TimingWheel();
+
+    void add(const std::shared_ptr<Timer>& timer);
+    void remove(Timer* timer);
+    // 下一个需要处理的时间点, 可能是高层槽位降级的时间, 不晚于最早的到期时间
+    // 没有定时器时返回 ~0ull
+    uint64_t getNextExpire() const;
+    // 推进到 now_ms, 到期的定时器按到期先后放入 expired
+    void advance(uint64_t now_ms, std::vector<std::shared_ptr<Timer> >& expired);
+    // 取出所有定时器, 时间推进到 now_ms
+    void clear(uint64_t now_ms, std::vector<std::shared_ptr<Timer> >& timers);
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+private:
+    // 按到期时间放入槽位, 早于 min_expire 的按 min_expire 放
+    void insert(Timer* timer, uint64_t min_expire);
+    // 把槽位中的链表整个取出
+    Timer* takeSlot(int level, size_t index);
+    // 高层槽位中的定时器重新放入低层
+    void cascade(int level, size_t index);
+private:
+    static const int LEVELS = 5;
+    static const int ROOT_BITS = 8;
+    static const int LEVEL_BITS = 6;
+    static const size_t ROOT_SIZE = 1 << ROOT_BITS;
+    static const size_t LEVEL_SIZE = 1 << LEVEL_BITS;
+    // 每个槽位是一个双向链表的头, 第 0 层 ROOT_SIZE 个, 其他层 LEVEL_SIZE 个
+    Timer* m_root[ROOT_SIZE] = {};
+    Timer* m_levels[LEVELS - 1][LEVEL_SIZE] = {};
+    // 每层的定时器数, 用于跳过空层
+    size_t m_counts[LEVELS] = {};
+    size_t m_size = 0;
+    // 已经处理到的时间, 这一毫秒及之前的定时器都已取出
+    uint64_t m_now = 0;
+};
+
 class Timer : public std::enable_shared_from_this<Timer> {
 friend class TimerManager;
+friend class TimingWheel;
 public:
     // 定义此类的智能指针
     typedef std::shared_ptr<Timer> ptr;
@@ -22,19 +71,57 @@ public:
 private:
     // 执行间隔, 回调函数, 是否循环, 定时器管理器
     Timer(uint64_t ms, std::function<void()> cb,
-            bool recurring, TimerManager* manager);
+            bool recurring, TimerManager* manager, uint64_t slack = 0);
     Timer(uint64_t next);
+    // 设置下次执行时间, 有余量时向上对齐到余量的整数倍
+    void setNext(uint64_t next);
+    // 重新计算下次执行时间, 调用方已经把定时器移出存储
+    // ms 为 ~0ull 时周期不变, start 为 ~0ull 时从上次的起点算
+    void update(uint64_t ms, uint64_t start);
 private:
+    enum State {
+        ACTIVE = 0,
+        // 已取消, 回调由所属线程释放
+        CANCELLED = 1,
+        // 非循环定时器已触发
+        DONE = 2,
+    };
+    enum Op {
+        OP_CANCEL = 1,
+        OP_REQUEUE = 2,
+    };
     // 是否循环
     bool m_recurring = false;     
+    // 允许推迟触发的余量(毫秒), 0 为不推迟
+    uint64_t m_slack = 0;
     // 执行周期
     uint64_t m_ms = 0;             
-    // 下次执行的精确时间
+    // 下次执行的精确时间, 单调时钟
     uint64_t m_next = 0; 
     // 回调函数          
     std::function<void()> m_cb;
     // 定时器管理器
     TimerManager* m_manager = nullptr;
+    // 时间轮模式: 所在槽位的链表, 所在层, 在时间轮中时持有自身的引用
+    Timer* m_wheelPrev = nullptr;
+    Timer* m_wheelNext = nullptr;
+    Timer** m_wheelSlot = nullptr;
+    int m_wheelLevel = 0;
+    Timer::ptr m_wheelSelf;
+    // 所属工作线程的分片, -1 为加锁的公共分片
+    // 只会从工作线程的分片移到公共分片, 不会反向
+    std::atomic<int> m_shard = {-1};
+    // ACTIVE/CANCELLED/DONE, 取消和到期通过 CAS 决定谁生效
+    std::atomic<int> m_state = {0};
+    // 其他线程发给所属分片的操作(OP_CANCEL/OP_REQUEUE 的组合)
+    // 不为 0 时已经在所属分片的 inbox 中, 不会重复入队
+    std::atomic<int> m_ops = {0};
+    // inbox 链表的下一个, 在 inbox 中时持有自身的引用
+    Timer* m_inboxNext = nullptr;
+    Timer::ptr m_inboxSelf;
+    // OP_REQUEUE 的参数: 新的周期(~0ull 为不变), 起始时间(~0ull 为从上次的起点算)
+    std::atomic<uint64_t> m_reqMs = {~0ull};
+    std::atomic<uint64_t> m_reqStart = {~0ull};
 private:
     // 比较定时器的智能指针大小(执行时间排序)
     struct Comparator {
@@ -42,42 +129,118 @@ private:
     };
 };
 
+// 定时器管理器
+// 绑定了工作线程的 TimerManager(IOManager) 为每个工作线程建一个分片, 线程上添加的定时器
+// 放在自己的分片中, 只由该线程在空闲时检查和触发, 不加锁
+// 其他线程取消或重设这些定时器时, 通过无锁的 inbox 发给所属线程处理
+// 非工作线程添加的定时器放在加锁的公共分片中, 由任意空闲线程触发
+// 时间取自缓存的单调时钟 GetCoarseMS, 不受系统时间调整的影响
 class TimerManager {
 friend class Timer;
 public:
     typedef RWMutex RWMutexType;
 
+    // 定时器的存储方式
+    enum Type {
+        // 按到期时间排序的 set, 添加和删除 O(log n)
+        SET = 0,
+        // 分层时间轮, 添加和删除 O(1), 毫秒精度
+        WHEEL = 1,
+    };
+
+    // 存储方式由配置 timer.type 决定
     TimerManager();
+    TimerManager(Type type);
     virtual ~TimerManager();
 
+    Type getType() const { return m_type; }
+
+    // slack_ms: 定时器可以推迟触发的余量, 到期时间相近的定时器合并到同一时刻触发
+    // 减少大量超时定时器造成的唤醒, 触发时间最多晚 slack_ms - 1 毫秒
     Timer::ptr addTimer(uint64_t ms, std::function<void()> cb
-                        , bool recurring = false);
+                        , bool recurring = false, uint64_t slack_ms = 0);
     // 添加条件定时器
     Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb
                                 , std::weak_ptr<void> weak_cond
-                                , bool recurring = false);
+                                , bool recurring = false
+                                , uint64_t slack_ms = 0);
+    // 复用 timer 指向的非循环定时器, 从现在起 ms 后执行 cb
+    // 定时器已经触发或取消, 且在当前线程的分片中没有别的操作未处理时, 直接放回分片, 不分配内存
+    // 否则取消它并新建一个放入 timer; cb 只捕获少量指针时 std::function 也不分配
+    void rearmTimer(Timer::ptr& timer, uint64_t ms, std::function<void()> cb
+                    , uint64_t slack_ms = 0);
+    // 当前线程需要关心的最近一个定时器: 自己的分片和公共分片
     uint64_t getNextTimer();
-    // 获取需要执行的回调函数的列表
+    // 获取需要执行的回调函数的列表, 同样只检查自己的分片和公共分片
     void listExpiredCb(std::vector<std::function<void()> >& cbs);
-    // 是否有定时器
+    // 是否有定时器, 包括所有分片
     bool hasTimer();
 protected:
-    // 有定时器插入到定时器的首部时, 执行该函数
+    // 有定时器插入到公共分片的首部时, 执行该函数
     virtual void onTimerInsertedAtFront() = 0;
-    // 添加定时器到管理器中
+    // 其他线程重设了分片 shard 中的定时器, 需要唤醒所属线程重新计算超时
+    virtual void onTimerShardChanged(int /*shard*/) {}
+    // 添加定时器到公共分片中
     // 注意这里传的是锁的引用
     void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
+    // 创建 count 个工作线程分片, 在工作线程启动前调用
+    void initTimerShards(size_t count);
+    // 当前线程开始处理分片 shard
+    void bindTimerShard(int shard);
+    // 当前线程不再处理自己的分片(线程退出), 剩下的定时器移到公共分片
+    void unbindTimerShard();
 private:
-    // 检测服务器时间是否被调后了
-    bool detectClockRollover(uint64_t now_ms);
+    // 一组定时器, 按 m_type 用 set 或时间轮存储
+    struct Shard {
+        Shard(Type type, uint64_t now_ms);
+        ~Shard();
+        // 放入定时器, 返回是否成为最早到期的定时器
+        bool insert(const Timer::ptr& timer);
+        // 不在其中时返回 false
+        bool remove(Timer* timer);
+        // 最早的到期时间, 时间轮为下一个需要处理的时间点, 没有时为 ~0ull
+        uint64_t getNext() const;
+        // 取出 now_ms 及之前到期的定时器
+        void takeExpired(uint64_t now_ms, std::vector<Timer::ptr>& expired);
+        // 取出所有定时器
+        void takeAll(std::vector<Timer::ptr>& timers);
+
+        std::set<Timer::ptr, Timer::Comparator> timers;
+        TimingWheel* wheel = nullptr;
+        // 定时器数, 公共分片在不加锁时用它判断是否为空
+        std::atomic<size_t> size = {0};
+        // 时间轮模式: 最近一次 getNextTimer 得到的绝对时间, 更早到期的定时器需要唤醒空闲线程
+        std::atomic<uint64_t> wakeTime = {~0ull};
+        // 其他线程发来的操作, 无锁的单向链表, 所属线程整个取走处理
+        std::atomic<Timer*> inbox = {nullptr};
+    };
+
+    // 当前线程绑定的分片, 没有时为 -1
+    int getCurrentShard() const;
+    bool cancelTimer(Timer* timer);
+    // 重设定时器, ms 为 ~0ull 时周期不变, from_now 为 false 时从上次的起点算
+    bool requeueTimer(Timer* timer, uint64_t ms, bool from_now);
+    // 把操作发到定时器所属分片的 inbox
+    void postTimerOp(Timer* timer, int shard, int op);
+    // 处理分片 shard 的 inbox, 由所属线程调用
+    void drainInbox(int shard);
+    // 在分片 s 中执行 inbox 中的操作, s 为公共分片时调用方持有写锁
+    void applyTimerOps(Shard* s, Timer* timer, int ops);
+    // 取出分片中到期的定时器放入 cbs, s 为公共分片时调用方持有写锁
+    void expireShard(Shard* s, uint64_t now_ms
+                    , std::vector<std::function<void()> >& cbs);
 private:
+    // 保护公共分片
     RWMutexType m_mutex;
-    // 定时器集合
-    std::set<Timer::ptr, Timer::Comparator> m_timers;
+    Type m_type = SET;
+    // 公共分片
+    Shard* m_shared = nullptr;
+    // 工作线程的分片, 下标为工作线程序号
+    std::vector<Shard*> m_shards;
+    // 所有分片中还有效的定时器数
+    std::atomic<size_t> m_timerCount = {0};
     // 是否触发 onTimerInsertedAtFront()
-    bool m_tickled = false;
-    // 上次执行时间
-    uint64_t m_previousTime = 0;
+    std::atomic<bool> m_tickled = {false};
 };
 
 }
@@ -0,0 +1,176 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+namespace sylar {
+
+IoUring::IoUring() {
+}
+
+IoUring::~IoUring() {
+    if (m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool IoUring::init(uint32_t entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        std::cout << "io_uring_setup(" << entries << ") errno=" << errno
+                << " errstr=" << strerror(errno) << std::endl;
+        return false;
+    }
+    m_fd = fd;
+    // 等待时的超时通过 EXT_ARG 传入, 完成队列满时内核不丢弃事件
+    if (!(params.features & IORING_FEAT_EXT_ARG)
+            || !(params.features & IORING_FEAT_NODROP)) {
+        std::cout << "io_uring features=" << params.features
+                << " lack EXT_ARG or NODROP" << std::endl;
+        return false;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // 新内核的两个队列可以映射在一起
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE
+                    , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE
+                        , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            return false;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE
+                        , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)m_sqRing;
+    m_sqHead = (uint32_t*)(sq + params.sq_off.head);
+    m_sqTail = (uint32_t*)(sq + params.sq_off.tail);
+    m_sqArray = (uint32_t*)(sq + params.sq_off.array);
+    m_sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_localTail = *m_sqTail;
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (uint32_t*)(cq + params.cq_off.head);
+    m_cqTail = (uint32_t*)(cq + params.cq_off.tail);
+    m_cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+bool IoUring::reserve(uint32_t n) {
+    if (m_sqEntries - getUnsubmitted() >= n) {
+        return true;
+    }
+    submit();
+    return m_sqEntries - getUnsubmitted() >= n;
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    if (!reserve(1)) {
+        return nullptr;
+    }
+    uint32_t index = m_localTail & m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    ++m_localTail;
+    return sqe;
+}
+
+uint32_t IoUring::getUnsubmitted() const {
+    return m_localTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+}
+
+int IoUring::submit() {
+    uint32_t count = getUnsubmitted();
+    if (!count) {
+        return 0;
+    }
+    __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+    int rt = enter(count, 0, 0);
+    if (rt < 0) {
+        std::cout << "io_uring_enter submit=" << count << " errno=" << errno
+                << " errstr=" << strerror(errno) << std::endl;
+    }
+    return rt;
+}
+
+int IoUring::submitAndWait(uint64_t timeout_ms) {
+    uint32_t count = 0;
+    {
+        MutexType::Lock lock(m_mutex);
+        count = getUnsubmitted();
+        __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+    }
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms != ~0ull) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = timeout_ms % 1000 * 1000000;
+        arg.ts = (uint64_t)&ts;
+    }
+    // 其他线程可能同时提交, 内核只会取走实际排队的请求
+    return enter(count, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG
+                , &arg, sizeof(arg));
+}
+
+size_t IoUring::reap(io_uring_cqe* cqes, size_t max) {
+    uint32_t head = *m_cqHead;
+    uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (head != tail && n < max) {
+        cqes[n++] = m_cqes[head & m_cqMask];
+        ++head;
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+int IoUring::enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags
+                    , void* arg, size_t argsz) {
+    int rt;
+    do {
+        rt = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete
+                    , flags, arg, argsz);
+    } while (rt < 0 && errno == EINTR && !min_complete);
+    return rt;
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+// 直接通过系统调用使用的 io_uring, 不依赖 liburing
+// 提交队列可以被多个线程写入, 由 mutex 保护; 完成队列只由所属线程读取
+class IoUring : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    IoUring();
+    ~IoUring();
+
+    // 创建 io_uring 并映射队列, 内核不支持或缺少需要的特性时返回 false
+    bool init(uint32_t entries);
+    bool isValid() const { return m_fd >= 0; }
+    MutexType& getMutex() { return m_mutex; }
+
+    // 保证提交队列至少有 n 个空位, 不够时先把已有的请求提交给内核, 调用方持有 mutex
+    // 链接在一起的请求需要先预留, 避免中间被拆开提交
+    bool reserve(uint32_t n);
+    // 取一个清零的 sqe, 没有空位时返回 nullptr, 调用方持有 mutex
+    io_uring_sqe* getSqe();
+    // 已填写但还没被内核取走的请求数, 调用方持有 mutex
+    uint32_t getUnsubmitted() const;
+    // 把排队的请求提交给内核, 返回提交的个数, 调用方持有 mutex
+    int submit();
+    // 提交排队的请求并等待至少一个完成事件, timeout_ms 为 ~0ull 时一直等待
+    // 由所属线程调用, 内部加锁
+    int submitAndWait(uint64_t timeout_ms);
+    // 取出最多 max 个完成事件, 只由所属线程调用
+    size_t reap(io_uring_cqe* cqes, size_t max);
+private:
+    int enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags
+                , void* arg = nullptr, size_t argsz = 0);
+private:
+    int m_fd = -1;
+    MutexType m_mutex;
+    // 提交队列
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    uint32_t* m_sqHead = nullptr;
+    uint32_t* m_sqTail = nullptr;
+    uint32_t* m_sqArray = nullptr;
+    uint32_t m_sqMask = 0;
+    uint32_t m_sqEntries = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+    // 本地的队尾, 提交时才写回共享内存
+    uint32_t m_localTail = 0;
+    // 完成队列
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    uint32_t* m_cqHead = nullptr;
+    uint32_t* m_cqTail = nullptr;
+    uint32_t m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+
+}
+
+#endif
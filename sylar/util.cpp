@@ -8,6 +8,8 @@
 #include <sstream>
 #include <cstdarg>
 #include <sys/time.h>
+#include <time.h>
+#include <algorithm>
 
 namespace sylar {
 
@@ -57,6 +59,68 @@ uint64_t GetCurrentUS() {
     return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
 
+uint64_t GetMonotonicMS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+uint64_t GetMonotonicUS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
+// 缓存的单调时钟, 为 0 时没有缓存
+static thread_local uint64_t t_coarse_ms = 0;
+
+uint64_t GetCoarseMS() {
+    return t_coarse_ms ? t_coarse_ms : GetMonotonicMS();
+}
+
+uint64_t UpdateCoarseClock() {
+    t_coarse_ms = GetMonotonicMS();
+    return t_coarse_ms;
+}
+
+void ClearCoarseClock() {
+    t_coarse_ms = 0;
+}
+
+int GetNumaNode() {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+        return -1;
+    }
+    return node;
+}
+
+int GetNumaNodeCount() {
+    // 内容形如 "0" 或 "0-1", 取最大的节点号加一
+    static int s_count = []() {
+        FILE* fp = fopen("/sys/devices/system/node/online", "r");
+        if (!fp) {
+            return 1;
+        }
+        char buf[256] = {0};
+        size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        int max_node = 0;
+        int cur = 0;
+        for (size_t i = 0; i < len; ++i) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                cur = cur * 10 + buf[i] - '0';
+                max_node = std::max(max_node, cur);
+            } else {
+                cur = 0;
+            }
+        }
+        return max_node + 1;
+    }();
+    return s_count;
+}
+
 std::string Time2Str(time_t ts, const std::string& format) {
     struct tm tm;
     localtime_r(&ts, &tm);
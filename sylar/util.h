@@ -21,6 +21,21 @@ std::string BacktraceToString(int size, int skip,
 uint64_t GetCurrentMS();    // 获取系统时间, 毫秒
 uint64_t GetCurrentUS();    // 获取系统时间, 微妙
 
+// 单调时钟, 不受系统时间调整的影响, 只用于计算时间间隔
+uint64_t GetMonotonicMS();
+uint64_t GetMonotonicUS();
+// 当前线程缓存的单调时钟, 毫秒, 只是读一个线程局部变量
+// 调度线程在每次空闲循环醒来和每个任务执行完后刷新, 误差不超过当前任务已执行的时间
+// 没有刷新过的线程直接读时钟
+uint64_t GetCoarseMS();
+// 刷新当前线程缓存的时钟, 返回新的值
+uint64_t UpdateCoarseClock();
+// 停止缓存, 之后 GetCoarseMS 直接读时钟, 线程离开调度器时调用
+void ClearCoarseClock();
+
+int GetNumaNode();          // 获取当前线程所在 CPU 的 NUMA 节点, 失败返回 -1
+int GetNumaNodeCount();     // 获取 NUMA 节点数, 读取失败时为 1
+
 std::string Time2Str(time_t ts = time(0), const std::string& format = "%Y-%m-%d %H:%M:%S");
 time_t Str2Time(const char* str, const char* format = "%Y-%m-%d %H:%M:%S");
 
@@ -0,0 +1,27 @@
+#include "alloc_counter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> s_allocs = {0};
+
+uint64_t GetAllocCount() {
+    return s_allocs;
+}
+
+void* operator new(size_t size) {
+    ++s_allocs;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
@@ -0,0 +1,10 @@
+#ifndef __SYLAR_TESTS_ALLOC_COUNTER_H__
+#define __SYLAR_TESTS_ALLOC_COUNTER_H__
+
+#include <stdint.h>
+
+// 测试用的全局 operator new 替换, 统计堆分配次数
+// 需要统计的测试把 alloc_counter.cpp 一起编译进去
+uint64_t GetAllocCount();
+
+#endif
@@ -0,0 +1,155 @@
+#include "sylar/sylar.h"
+#include "sylar/channel.h"
+#include <iostream>
+#include <atomic>
+
+struct Request {
+    int id;
+    std::string body;
+    long weight = 0;
+};
+
+// parse -> enrich -> respond 三级流水线, enrich 在另一个 IOManager 中
+// 请求用 unique_ptr 传递, 通道只移动不拷贝
+void test_pipeline(sylar::IOManager& front, sylar::IOManager& back, sylar::WaitGroup& wg) {
+    typedef sylar::Channel<std::unique_ptr<Request> > RequestChannel;
+    static RequestChannel s_parsed(16);
+    static RequestChannel s_enriched(16);
+    static std::atomic<long> s_sum = {0};
+    static std::atomic<int> s_enrichers = {0};
+    static sylar::WaitGroup s_parsers;
+    const int parsers = 4;
+    const int enrichers = 4;
+    const int items = 20000;
+
+    wg.add(enrichers + 1);
+    s_parsers.add(parsers);
+    for (int p = 0; p < parsers; ++p) {
+        front.schedule([p]() {
+            for (int i = 1; i <= items; ++i) {
+                std::unique_ptr<Request> req(new Request);
+                req->id = i;
+                req->body = std::to_string(p * items + i);
+                s_parsed.send(std::move(req));
+            }
+            s_parsers.done();
+        });
+    }
+    for (int e = 0; e < enrichers; ++e) {
+        back.schedule([&wg]() {
+            std::unique_ptr<Request> req;
+            while (s_parsed.recv(req)) {
+                req->weight = std::stol(req->body);
+                s_enriched.send(std::move(req));
+            }
+            // 最后一个退出的 enrich 协程关闭下一级
+            if (++s_enrichers == enrichers) {
+                s_enriched.close();
+            }
+            wg.done();
+        });
+    }
+    front.schedule([&wg]() {
+        std::unique_ptr<Request> req;
+        int count = 0;
+        while (s_enriched.recv(req)) {
+            s_sum += req->weight;
+            ++count;
+        }
+        long n = (long)parsers * items;
+        std::cout << "pipeline count=" << count << " sum=" << s_sum
+            << " expect=" << n * (n + 1) / 2 << std::endl;
+        wg.done();
+    });
+    // 所有 parse 协程结束后关闭第一级
+    front.schedule([]() {
+        s_parsers.wait();
+        s_parsed.close();
+    });
+}
+
+// 一个协程 Select 两个通道, 直到两个都关闭
+void test_select(sylar::IOManager& iom, sylar::WaitGroup& wg) {
+    static sylar::Channel<int> s_ints(4);
+    static sylar::Channel<std::string> s_strs(4);
+    const int items = 10000;
+    wg.add(3);
+    iom.schedule([&wg]() {
+        for (int i = 1; i <= items; ++i) {
+            s_ints.send(i);
+        }
+        s_ints.close();
+        wg.done();
+    });
+    iom.schedule([&wg]() {
+        for (int i = 0; i < items; ++i) {
+            s_strs.send(std::string("x"));
+        }
+        s_strs.close();
+        wg.done();
+    });
+    iom.schedule([&wg]() {
+        int v = 0;
+        std::string s;
+        long sum = 0;
+        size_t chars = 0;
+        std::vector<sylar::ChannelCase> cases = {s_ints.recvCase(v), s_strs.recvCase(s)};
+        int open = 2;
+        while (open > 0) {
+            int i = sylar::ChannelBase::Select(cases);
+            if (!cases[i].ok) {
+                // 去掉已经关闭的分支
+                --open;
+                cases.erase(cases.begin() + i);
+                continue;
+            }
+            if (cases[i].channel == &s_ints) {
+                sum += v;
+            } else {
+                chars += s.size();
+            }
+        }
+        std::cout << "select sum=" << sum << " expect=" << (long)items * (items + 1) / 2
+            << " chars=" << chars << " expect=" << items << std::endl;
+        wg.done();
+    });
+}
+
+// 关闭后 send 失败, recv 读完剩余数据后失败
+void test_close() {
+    sylar::Channel<int> ch(4);
+    bool sent = ch.trySend(1) && ch.trySend(2);
+    ch.close();
+    int a = 0;
+    int b = 0;
+    int c = 0;
+    bool r1 = ch.tryRecv(a);
+    bool r2 = ch.tryRecv(b);
+    bool r3 = ch.tryRecv(c);
+    std::cout << "close sent=" << sent << " send_after_close=" << ch.trySend(3)
+        << " recv=" << r1 << r2 << r3 << " values=" << a << b << std::endl;
+}
+
+int main(int argc, char** argv) {
+    test_close();
+    std::atomic<int> finished = {0};
+    {
+        sylar::IOManager front(2, false, "front");
+        sylar::IOManager back(2, false, "back");
+        sylar::WaitGroup wg[2];
+        test_pipeline(front, back, wg[0]);
+        test_select(back, wg[1]);
+        front.schedule([&]() {
+            for (auto& i : wg) {
+                i.wait();
+            }
+            ++finished;
+        });
+        while (!finished) {
+            usleep(10000);
+        }
+        back.stop();
+        front.stop();
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "sylar/sylar.h"
+#include <iostream>
+#include <ucontext.h>
+
+// 比较 ucontext 和汇编两种上下文切换的速度, 每次往返计为两次切换
+static const uint64_t s_rounds = 2000000;
+static const size_t s_stack_size = 128 * 1024;
+
+static ucontext_t s_main_uctx;
+static ucontext_t s_uctx;
+
+static void ucontext_func() {
+    while (true) {
+        swapcontext(&s_uctx, &s_main_uctx);
+    }
+}
+
+void bench_ucontext() {
+    std::vector<char> stack(s_stack_size);
+    getcontext(&s_uctx);
+    s_uctx.uc_link = nullptr;
+    s_uctx.uc_stack.ss_sp = &stack[0];
+    s_uctx.uc_stack.ss_size = stack.size();
+    makecontext(&s_uctx, &ucontext_func, 0);
+
+    uint64_t start = sylar::GetCurrentUS();
+    for (uint64_t i = 0; i < s_rounds; ++i) {
+        swapcontext(&s_main_uctx, &s_uctx);
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    std::cout << "ucontext: " << s_rounds * 2 * 1000000 / (used ? used : 1) 
+        << " switches/s" << std::endl;
+}
+
+#if SYLAR_HAS_ASM_CONTEXT
+static sylar::fcontext_t s_main_fctx;
+static sylar::fcontext_t s_fctx;
+
+static void fcontext_func() {
+    while (true) {
+        sylar_jump_fcontext(&s_fctx, s_main_fctx);
+    }
+}
+
+void bench_fcontext() {
+    std::vector<char> stack(s_stack_size);
+    s_fctx = sylar::make_fcontext(&stack[0], stack.size(), &fcontext_func);
+
+    uint64_t start = sylar::GetCurrentUS();
+    for (uint64_t i = 0; i < s_rounds; ++i) {
+        sylar_jump_fcontext(&s_main_fctx, s_fctx);
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    std::cout << "asm: " << s_rounds * 2 * 1000000 / (used ? used : 1) 
+        << " switches/s" << std::endl;
+}
+#endif
+
+// 通过 Fiber 的 call/back 切换, 使用编译时选择的实现
+void bench_fiber() {
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber([](){
+        for (uint64_t i = 0; i < s_rounds; ++i) {
+            sylar::Fiber::GetThis()->back();
+        }
+    }, s_stack_size, true));
+
+    uint64_t start = sylar::GetCurrentUS();
+    for (uint64_t i = 0; i < s_rounds; ++i) {
+        fiber->call();
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    fiber->call();
+    std::cout << "Fiber(" << (SYLAR_FIBER_ASM_CONTEXT ? "asm" : "ucontext") << "): "
+        << s_rounds * 2 * 1000000 / (used ? used : 1) << " switches/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_ucontext();
+#if SYLAR_HAS_ASM_CONTEXT
+    bench_fcontext();
+#endif
+    bench_fiber();
+    return 0;
+}
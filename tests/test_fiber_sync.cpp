@@ -0,0 +1,156 @@
+#include "sylar/sylar.h"
+#include "sylar/fiber_sync.h"
+#include <iostream>
+#include <atomic>
+#include <deque>
+
+// 多个线程上的协程争用同一把锁, 临界区中让出, 检查互斥和计数
+void test_mutex(sylar::IOManager& iom, sylar::WaitGroup& wg) {
+    static sylar::FiberMutex s_mutex;
+    static int s_counter = 0;
+    static std::atomic<int> s_inside = {0};
+    static std::atomic<int> s_overlap = {0};
+    const int fibers = 100;
+    const int loops = 1000;
+    wg.add(fibers);
+    for (int i = 0; i < fibers; ++i) {
+        iom.schedule([&wg]() {
+            for (int j = 0; j < loops; ++j) {
+                sylar::FiberMutex::Lock lock(s_mutex);
+                if (++s_inside != 1) {
+                    ++s_overlap;
+                }
+                int v = s_counter;
+                if (j % 10 == 0) {
+                    sylar::Fiber::YieldToReady();
+                }
+                s_counter = v + 1;
+                --s_inside;
+            }
+            wg.done();
+        });
+    }
+    iom.schedule([&wg]() {
+        wg.wait();
+        std::cout << "mutex counter=" << s_counter << " expect=" << fibers * loops
+            << " overlap=" << s_overlap << std::endl;
+    });
+}
+
+// 持有锁的协程 sleep 时, 同一线程上的其他协程照常运行
+void test_not_blocking(sylar::IOManager& iom, sylar::WaitGroup& wg) {
+    static sylar::FiberMutex s_mutex;
+    static std::atomic<int> s_ran = {0};
+    wg.add(2);
+    iom.schedule([&iom, &wg]() {
+        // 两个协程固定在同一个线程上
+        iom.schedule([&wg]() {
+            sylar::FiberMutex::Lock lock(s_mutex);
+            uint64_t t0 = sylar::GetMonotonicMS();
+            usleep(200 * 1000);
+            std::cout << "held lock for " << sylar::GetMonotonicMS() - t0
+                << "ms, others ran " << s_ran << " times" << std::endl;
+            wg.done();
+        }, sylar::Scheduler::THIS_THREAD);
+        iom.schedule([&wg]() {
+            for (int i = 0; i < 10; ++i) {
+                ++s_ran;
+                usleep(10 * 1000);
+            }
+            wg.done();
+        }, sylar::Scheduler::THIS_THREAD);
+    });
+}
+
+// 有界队列上的生产者和消费者
+void test_condition(sylar::IOManager& iom, sylar::WaitGroup& wg) {
+    static sylar::FiberMutex s_mutex;
+    static sylar::FiberCondition s_not_empty;
+    static sylar::FiberCondition s_not_full;
+    static std::deque<int> s_queue;
+    static std::atomic<long> s_sum = {0};
+    const int producers = 4;
+    const int items = 10000;
+    const size_t capacity = 8;
+    wg.add(producers * 2);
+    for (int p = 0; p < producers; ++p) {
+        iom.schedule([&wg]() {
+            for (int i = 1; i <= items; ++i) {
+                sylar::FiberMutex::Lock lock(s_mutex);
+                while (s_queue.size() >= capacity) {
+                    s_not_full.wait(lock);
+                }
+                s_queue.push_back(i);
+                s_not_empty.notify();
+            }
+            wg.done();
+        });
+        iom.schedule([&wg]() {
+            for (int i = 0; i < items; ++i) {
+                sylar::FiberMutex::Lock lock(s_mutex);
+                while (s_queue.empty()) {
+                    s_not_empty.wait(lock);
+                }
+                s_sum += s_queue.front();
+                s_queue.pop_front();
+                s_not_full.notify();
+            }
+            wg.done();
+        });
+    }
+    iom.schedule([&wg]() {
+        wg.wait();
+        std::cout << "condition sum=" << s_sum
+            << " expect=" << (long)producers * items * (items + 1) / 2 << std::endl;
+    });
+}
+
+// 信号量限制同时运行的协程数
+void test_semaphore(sylar::IOManager& iom, sylar::WaitGroup& wg) {
+    static sylar::FiberSemaphore s_sem(3);
+    static std::atomic<int> s_running = {0};
+    static std::atomic<int> s_max = {0};
+    const int fibers = 50;
+    wg.add(fibers);
+    for (int i = 0; i < fibers; ++i) {
+        iom.schedule([&wg]() {
+            s_sem.wait();
+            int n = ++s_running;
+            int m = s_max;
+            while (n > m && !s_max.compare_exchange_weak(m, n)) {
+            }
+            usleep(1000);
+            --s_running;
+            s_sem.notify();
+            wg.done();
+        });
+    }
+    iom.schedule([&wg]() {
+        wg.wait();
+        std::cout << "semaphore max_running=" << s_max << " count=" << s_sem.getCount() << std::endl;
+    });
+}
+
+int main(int argc, char** argv) {
+    std::atomic<int> finished = {0};
+    {
+        sylar::IOManager iom(4, false, "test_fiber_sync");
+        sylar::WaitGroup wg[4];
+        test_mutex(iom, wg[0]);
+        test_not_blocking(iom, wg[1]);
+        test_condition(iom, wg[2]);
+        test_semaphore(iom, wg[3]);
+        // 所有测试结束后再停止
+        iom.schedule([&]() {
+            for (auto& i : wg) {
+                i.wait();
+            }
+            ++finished;
+        });
+        while (!finished) {
+            usleep(10000);
+        }
+        iom.stop();
+    }
+    return 0;
+}
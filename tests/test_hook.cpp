@@ -1,12 +1,18 @@
 #include "sylar/sylar.h"
 #include "sylar/iomanager.h"
 #include "sylar/log.h"
+#include "sylar/config.h"
+#include "sylar/fd_manager.h"
+#include "sylar/hook.h"
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <atomic>
+#include "alloc_counter.h"
 
 void test_sleep() {
     sylar::IOManager iom(1);
@@ -58,7 +64,133 @@ void test_sock() {
     std::cout << buff << std::endl;
 }
 
+// 设置了接收超时的 socketpair 上两个协程来回收发小消息, 每次 recv 都要挂起等待
+// 统计每个来回的耗时和堆分配次数
+void test_timed_pingpong(const std::string& timer_type) {
+    sylar::Config::Lookup<std::string>("timer.type")->setValue(timer_type);
+    const int rounds = 100000;
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    std::atomic<int> done = {0};
+    uint64_t begin = 0;
+    uint64_t begin_allocs = 0;
+    {
+        sylar::IOManager iom(1, false, "test_hook");
+        for (int i = 0; i < 2; ++i) {
+            iom.schedule([&, i]() {
+                int fd = fds[i];
+                sylar::FdMgr::GetInstance()->get(fd, true);
+                timeval tv = {5, 0};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                char buf[16] = "ping";
+                if (i == 0) {
+                    begin = sylar::GetMonotonicUS();
+                    begin_allocs = GetAllocCount();
+                    send(fd, buf, 4, 0);
+                }
+                for (int r = 0; r < rounds; ++r) {
+                    if (recv(fd, buf, sizeof(buf), 0) != 4) {
+                        std::cout << "recv error errno=" << errno << std::endl;
+                        break;
+                    }
+                    if (i == 1 || r + 1 < rounds) {
+                        send(fd, buf, 4, 0);
+                    }
+                }
+                ++done;
+            });
+        }
+        while (done < 2) {
+            usleep(10000);
+        }
+        uint64_t used = sylar::GetMonotonicUS() - begin;
+        uint64_t allocs = GetAllocCount() - begin_allocs;
+        std::cout << timer_type << " pingpong rounds=" << rounds
+            << " " << (double)used * 1000 / rounds << " ns/round"
+            << " allocs/round=" << (double)allocs / rounds << std::endl;
+
+        // 没有数据时按超时返回
+        done = 0;
+        iom.schedule([&]() {
+            timeval tv = {0, 100000};
+            setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char buf[16];
+            uint64_t t0 = sylar::GetMonotonicMS();
+            int rt = recv(fds[0], buf, sizeof(buf), 0);
+            std::cout << "recv timeout rt=" << rt << " errno=" << errno
+                << " ms=" << sylar::GetMonotonicMS() - t0 << std::endl;
+            ++done;
+        });
+        while (done < 1) {
+            usleep(10000);
+        }
+        // hook 的 close 同时移除 FdCtx, 下一轮复用 fd 时重新设置非阻塞
+        done = 0;
+        iom.schedule([&]() {
+            close(fds[0]);
+            close(fds[1]);
+            ++done;
+        });
+        while (done < 1) {
+            usleep(10000);
+        }
+        iom.stop();
+    }
+}
+
+// 持久注册模式下 fd 不经过 hook 关闭(close_f), 同一个 fd 号由 hook 的 socket 重新创建后
+// recv 仍然要能等到数据, 不能沿用旧 fd 的注册状态
+void test_persistent_reuse() {
+    sylar::Config::Lookup<std::map<std::string, bool> >("iomanager.persistent")
+        ->setValue({{"test_persistent", true}});
+    std::atomic<int> done = {0};
+    sylar::IOManager iom(1, false, "test_persistent");
+    iom.schedule([&]() {
+        int sender = socket(AF_INET, SOCK_DGRAM, 0);
+        int last_fd = -1;
+        for (int round = 0; round < 2; ++round) {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(fd, (sockaddr*)&addr, sizeof(addr));
+            socklen_t len = sizeof(addr);
+            getsockname(fd, (sockaddr*)&addr, &len);
+            timeval tv = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            // 等 recv 挂起之后再发送
+            sylar::IOManager::GetThis()->schedule([sender, addr]() {
+                usleep(50 * 1000);
+                sendto(sender, "ping", 4, 0, (const sockaddr*)&addr, sizeof(addr));
+            });
+            char buf[16];
+            int rt = recv(fd, buf, sizeof(buf), 0);
+            std::cout << "persistent reuse round=" << round << " fd=" << fd
+                << " reused=" << (fd == last_fd) << " rt=" << rt
+                << " errno=" << (rt < 0 ? errno : 0) << std::endl;
+            last_fd = fd;
+            // 第一轮绕过 hook 关闭, 最后一轮经过 hook 关闭, 不给后面的测试留下 FdCtx
+            if (round == 0) {
+                close_f(fd);
+            } else {
+                close(fd);
+            }
+        }
+        close(sender);
+        ++done;
+    });
+    while (done < 1) {
+        usleep(10000);
+    }
+    iom.stop();
+}
+
 int main(int argc, char** argv) {
+    test_persistent_reuse();
+    test_timed_pingpong("set");
+    test_timed_pingpong("wheel");
+    // use_caller 的调度器结束后主线程仍然开启着 hook, 放在最后
     sylar::IOManager iom;
     iom.schedule(&test_sock);
     // test_sock();
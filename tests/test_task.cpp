@@ -0,0 +1,67 @@
+#include "sylar/sylar.h"
+#include <iostream>
+#include <atomic>
+#include "alloc_counter.h"
+
+static const uint64_t s_count = 100000;
+static std::atomic<uint64_t> s_sum = {0};
+
+// 典型的任务: 捕获一个 shared_ptr 和几个整数
+static std::function<void()> make_function(const std::shared_ptr<int>& sp, int a, int b, int c) {
+    return [sp, a, b, c]() { s_sum += *sp + a + b + c; };
+}
+
+void bench_construct() {
+    auto sp = std::make_shared<int>(1);
+
+    uint64_t before = GetAllocCount();
+    for (uint64_t i = 0; i < s_count; ++i) {
+        std::function<void()> f = make_function(sp, i, 2, 3);
+        std::function<void()> g = f;
+        g();
+    }
+    std::cout << "std::function: " << (double)(GetAllocCount() - before) / s_count
+        << " allocs/task" << std::endl;
+
+    before = GetAllocCount();
+    for (uint64_t i = 0; i < s_count; ++i) {
+        int a = i, b = 2, c = 3;
+        sylar::Task t([sp, a, b, c]() { s_sum += *sp + a + b + c; });
+        sylar::Task u(std::move(t));
+        u();
+    }
+    std::cout << "Task: " << (double)(GetAllocCount() - before) / s_count
+        << " allocs/task" << std::endl;
+}
+
+// 经过 schedule, 出队, 在协程中执行的完整路径
+void bench_schedule() {
+    sylar::Scheduler sc(1, false, "test_task");
+    sc.start();
+    auto sp = std::make_shared<int>(1);
+
+    for (int round = 0; round < 3; ++round) {
+        uint64_t before = GetAllocCount();
+        // 每批 1000 个, 队列中的任务数不超过保留的空节点数
+        for (uint64_t i = 0; i < s_count; i += 1000) {
+            uint64_t target = s_sum + 1000 * 7;
+            for (uint64_t j = 0; j < 1000; ++j) {
+                int a = 1, b = 2, c = 3;
+                sc.schedule([sp, a, b, c]() { s_sum += *sp + a + b + c; });
+            }
+            while (s_sum < target) {
+                sched_yield();
+            }
+        }
+        // 第一轮需要分配队列节点和协程, 之后复用
+        std::cout << "schedule round " << round << ": "
+            << (double)(GetAllocCount() - before) / s_count << " allocs/task" << std::endl;
+    }
+    sc.stop();
+}
+
+int main(int argc, char** argv) {
+    bench_construct();
+    bench_schedule();
+    return 0;
+}
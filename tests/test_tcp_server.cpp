@@ -0,0 +1,87 @@
+#include "sylar/sylar.h"
+#include "sylar/tcp_server.h"
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <arpa/inet.h>
+
+static std::atomic<int> s_handled = {0};
+
+// 回复一个 "ok" 后关闭连接
+class OkServer : public sylar::TcpServer {
+public:
+    OkServer(sylar::IOManager* worker)
+        :sylar::TcpServer(worker, worker, worker) {
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        ++s_handled;
+        client->send("ok", 2);
+        client->close();
+    }
+};
+
+// 不经过 hook 的阻塞客户端, 每个连接最多等 1 秒回复
+int run_clients(uint16_t port, int count) {
+    int ok = 0;
+    for (int i = 0; i < count; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        timeval tv = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        char buf[2];
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0
+                && recv(fd, buf, sizeof(buf), MSG_WAITALL) == 2) {
+            ++ok;
+        }
+        close(fd);
+    }
+    return ok;
+}
+
+// 分片模式使用默认的 use_caller, 根线程在 stop 之前不运行调度
+// 它不能拥有 SO_REUSEPORT 的 sock, 否则分到它上面的连接没有人 accept
+void test_sharded_accept() {
+    const int clients = 32;
+    sylar::IOManager iom(3, true, "accept", false, true);
+    sylar::TcpServer::ptr server(new OkServer(&iom));
+    std::atomic<int> port = {-1};
+    size_t socks = 0;
+    // 在调度器中 bind, sock 由 hook 设为非阻塞
+    iom.schedule([&]() {
+        if (!server->bind(sylar::IPv4Address::Create("127.0.0.1", 0))) {
+            std::cout << "sharded accept bind fail" << std::endl;
+            port = 0;
+            return ;
+        }
+        server->start();
+        socks = server->getSocks().size();
+        auto addr = server->getSocks()[0]->getLocalAddress();
+        port = std::dynamic_pointer_cast<sylar::IPAddress>(addr)->getPort();
+    });
+    while (port < 0) {
+        usleep(1000);
+    }
+    int ok = 0;
+    if (port > 0) {
+        std::thread t([&]() {
+            ok = run_clients(port, clients);
+        });
+        t.join();
+    }
+    server->stop();
+    iom.stop();
+    std::cout << "sharded accept shards=" << iom.getShardCount()
+        << " socks=" << socks
+        << " ok=" << ok << " handled=" << s_handled
+        << " expect=" << clients << std::endl;
+}
+
+int main(int argc, char** argv) {
+    test_sharded_accept();
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "sylar/sylar.h"
+#include "sylar/config.h"
+#include <iostream>
+#include <atomic>
+#include <random>
+
+// 比较 set 和时间轮两种定时器存储方式
+// 每个连接一个接收超时的场景: 大量定时器添加后在到期前被取消
+static const int s_count = 200000;
+
+class TestTimerManager : public sylar::TimerManager {
+public:
+    TestTimerManager(Type type)
+        :sylar::TimerManager(type) {
+    }
+protected:
+    void onTimerInsertedAtFront() override {}
+};
+
+// 比较每次读时钟和读缓存时钟的开销
+void bench_clock() {
+    const int n = 10000000;
+    volatile uint64_t sink = 0;
+    uint64_t begin = sylar::GetMonotonicUS();
+    for (int i = 0; i < n; ++i) {
+        sink = sink + sylar::GetCurrentMS();
+    }
+    uint64_t wall = sylar::GetMonotonicUS();
+    for (int i = 0; i < n; ++i) {
+        sink = sink + sylar::GetMonotonicMS();
+    }
+    uint64_t monotonic = sylar::GetMonotonicUS();
+    // 调度线程中由空闲循环和任务切换刷新, 这里手动刷新一次
+    sylar::UpdateCoarseClock();
+    for (int i = 0; i < n; ++i) {
+        sink = sink + sylar::GetCoarseMS();
+    }
+    sylar::ClearCoarseClock();
+    uint64_t coarse = sylar::GetMonotonicUS();
+    std::cout << "GetCurrentMS: " << (double)(wall - begin) * 1000 / n << " ns/call"
+        << " GetMonotonicMS: " << (double)(monotonic - wall) * 1000 / n << " ns/call"
+        << " GetCoarseMS: " << (double)(coarse - monotonic) * 1000 / n << " ns/call"
+        << std::endl;
+}
+
+// cached 为 true 时添加定时器读缓存的时钟, 和调度线程中一样
+void bench_add_cancel(sylar::TimerManager::Type type, bool cached) {
+    if (cached) {
+        sylar::UpdateCoarseClock();
+    }
+    TestTimerManager tm(type);
+    std::mt19937 rng(1);
+    std::vector<sylar::Timer::ptr> timers;
+    timers.reserve(s_count);
+
+    uint64_t begin = sylar::GetCurrentUS();
+    for (int i = 0; i < s_count; ++i) {
+        timers.push_back(tm.addTimer(1000 + rng() % 60000, [](){}));
+    }
+    uint64_t added = sylar::GetCurrentUS();
+    for (auto& timer : timers) {
+        timer->cancel();
+    }
+    uint64_t cancelled = sylar::GetCurrentUS();
+    sylar::ClearCoarseClock();
+    std::cout << (type == sylar::TimerManager::WHEEL ? "wheel" : "set  ")
+        << (cached ? " cached clock" : " system clock")
+        << " add: " << (double)(added - begin) * 1000 / s_count << " ns/timer"
+        << " cancel: " << (double)(cancelled - added) * 1000 / s_count << " ns/timer"
+        << std::endl;
+}
+
+// 在 IOManager 中检查定时器的触发时间
+void check_accuracy(const std::string& type) {
+    sylar::Config::Lookup<std::string>("timer.type")->setValue(type);
+    std::atomic<int> fired = {0};
+    std::atomic<int> early = {0};
+    std::atomic<uint64_t> max_late = {0};
+    {
+        sylar::IOManager iom(2, false, "test_timer");
+        std::mt19937 rng(2);
+        const int n = 2000;
+        for (int i = 0; i < n; ++i) {
+            uint64_t ms = rng() % 1000;
+            uint64_t due = sylar::GetMonotonicMS() + ms;
+            iom.addTimer(ms, [due, &fired, &early, &max_late]() {
+                uint64_t now = sylar::GetMonotonicMS();
+                if (now < due) {
+                    ++early;
+                } else if (now - due > max_late) {
+                    max_late = now - due;
+                }
+                ++fired;
+            });
+        }
+        // 超过一圈第 0 层的定时器和循环定时器
+        std::atomic<int> rounds = {0};
+        sylar::Timer::ptr recurring = iom.addTimer(300, [&rounds]() { ++rounds; }, true);
+        while (fired < n) {
+            usleep(10000);
+        }
+        recurring->cancel();
+        std::cout << type << " fired=" << fired << " early=" << early
+            << " max_late=" << max_late << "ms recurring=" << rounds << std::endl;
+        iom.stop();
+    }
+}
+
+// 工作线程上添加的定时器在自己的分片中, 由主线程取消一半, 另一半提前
+// 取消的不能触发, 提前的要按新的时间触发
+void check_cross_thread() {
+    const int n = 1000;
+    std::atomic<int> cancelled_fired = {0};
+    std::atomic<int> fired = {0};
+    std::atomic<uint64_t> max_late = {0};
+    std::vector<sylar::Timer::ptr> timers(n * 2);
+    std::atomic<int> created = {0};
+    {
+        sylar::IOManager iom(2, false, "test_timer_cross");
+        for (int t = 0; t < 2; ++t) {
+            iom.schedule([&, t]() {
+                for (int i = t; i < n * 2; i += 2) {
+                    timers[i] = sylar::IOManager::GetThis()->addTimer(2000, [&, i]() {
+                        if (i % 2 == 0) {
+                            ++cancelled_fired;
+                        }
+                        ++fired;
+                    });
+                }
+                ++created;
+            });
+        }
+        while (created < 2) {
+            usleep(1000);
+        }
+        uint64_t due = sylar::GetMonotonicMS() + 100;
+        for (int i = 0; i < n * 2; ++i) {
+            if (i % 2 == 0) {
+                timers[i]->cancel();
+            } else {
+                timers[i]->reset(100, true);
+            }
+        }
+        while (fired < n) {
+            usleep(1000);
+        }
+        max_late = sylar::GetMonotonicMS() - due;
+        iom.stop();
+    }
+    std::cout << "cross thread fired=" << fired << " cancelled_fired=" << cancelled_fired
+        << " late=" << max_late << "ms" << std::endl;
+}
+
+// 大量到期时间分散的超时定时器, 比较有无余量时的唤醒次数和最大延迟
+void check_slack(uint64_t slack) {
+    const int n = 10000;
+    std::atomic<int> fired = {0};
+    std::atomic<int> early = {0};
+    std::atomic<uint64_t> max_late = {0};
+    sylar::IOManager::PollStats stats;
+    {
+        sylar::IOManager iom(2, false, "test_timer_slack");
+        std::mt19937 rng(3);
+        for (int i = 0; i < n; ++i) {
+            uint64_t ms = 100 + rng() % 1000;
+            uint64_t due = sylar::GetMonotonicMS() + ms;
+            iom.addTimer(ms, [due, &fired, &early, &max_late]() {
+                uint64_t now = sylar::GetMonotonicMS();
+                if (now < due) {
+                    ++early;
+                } else if (now - due > max_late) {
+                    max_late = now - due;
+                }
+                ++fired;
+            }, false, slack);
+        }
+        while (fired < n) {
+            usleep(10000);
+        }
+        stats = iom.getPollStats();
+        iom.stop();
+    }
+    std::cout << "slack=" << slack << "ms fired=" << fired << " early=" << early
+        << " max_late=" << max_late << "ms poll_loops=" << stats.loops << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_clock();
+    bench_add_cancel(sylar::TimerManager::SET, false);
+    bench_add_cancel(sylar::TimerManager::SET, true);
+    bench_add_cancel(sylar::TimerManager::WHEEL, false);
+    bench_add_cancel(sylar::TimerManager::WHEEL, true);
+    check_accuracy("set");
+    check_accuracy("wheel");
+    check_cross_thread();
+    check_slack(0);
+    check_slack(50);
+    return 0;
+}